@@ -2,42 +2,451 @@
 #include <linux/cdev.h>
 #include <linux/parport.h>
 #include <linux/platform_device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
 #include <asm/uaccess.h>
 
 #define DEVICE_NAME "led"
 
+#define LED_MAX_PORTS   PARPORT_MAX     /* One minor per parallel port */
+#define LED_MAX_FRAMES  4096            /* Longest sequence per write() */
+#define LED_IOC_TIMED   _IO('l', 1)     /* Writes carry struct led_frame */
+#define LED_IOC_STICKY  _IO('l', 2)     /* Keep the port between writes */
+
+/* One frame of an LED sequence. By default every byte written to
+ * the device is a frame, and frames are spaced frame_period_us
+ * apart. After LED_IOC_TIMED, writes are arrays of struct led_frame
+ * and each frame carries its own hold time */
+struct led_frame {
+    unsigned int delay_us;      /* Hold time before the next frame */
+    unsigned char data;         /* Value for the data register */
+    unsigned char reserved[3];
+};
+
+/* Layout of the page shared with user space through mmap(). User
+ * space stores the desired LED byte and then increments seq. The
+ * flush work writes the latest byte to the port at most once every
+ * flush_interval_ms, so intermediate updates are coalesced */
+struct led_state {
+    unsigned int seq;           /* Bumped after each update */
+    unsigned char data;         /* Desired value for the data register */
+};
+
+/* Per-port device structure. Every parallel port gets its own
+ * pardevice, minor and class device, so writers to different
+ * ports never share a lock. Open files and mappings hold references,
+ * so the structure and the state page outlive led_detach() until the
+ * last of them goes away */
+struct led_dev {
+    struct cdev cdev;               /* Char device for this port */
+    struct pardevice *pdev;         /* Our handle on the port */
+    int minor;                      /* Parport number */
+    struct mutex mutex;             /* One sequence at a time */
+    struct kref ref;
+    int dead;                       /* Port detached */
+
+    /* Port ownership. In sticky mode the port stays claimed after a
+     * write and is only given up from led_preempt(), when another
+     * device asks for it */
+    spinlock_t claim_lock;
+    int claimed;                    /* We own the port */
+    int busy;                       /* A writer is using the port */
+    int wanted;                     /* Someone was refused the port */
+    int sticky;                     /* Set by LED_IOC_STICKY */
+    wait_queue_head_t port_wait;    /* poll() waits for the port here */
+
+    struct class_device *class_dev; /* /sys/class/led/ledN */
+    unsigned char data;             /* Last byte written to the port */
+
+    /* Sequence being played back by timer */
+    struct led_frame *frames;
+    int nr_frames, cur_frame;
+    struct hrtimer timer;
+    wait_queue_head_t play_wait;
+
+    /* Shared state page and the work that flushes it to the port */
+    struct led_state *state;
+    unsigned int flushed_seq;
+    atomic_t map_count;
+    struct delayed_work flush_work;
+};
+
+/* Per-open state */
+struct led_file {
+    struct led_dev *led;
+    int timed;                      /* Set by LED_IOC_TIMED */
+};
+
+static unsigned int frame_period_us = 10000;
+module_param(frame_period_us, uint, 0644);
+MODULE_PARM_DESC(frame_period_us, "Spacing of untimed frames in microseconds");
+
+static unsigned int flush_interval_ms = 10;
+module_param(flush_interval_ms, uint, 0644);
+MODULE_PARM_DESC(flush_interval_ms, "Minimum spacing of mmap'd state flushes");
+
 static dev_t dev_number;
 static struct class *led_class;
-struct cdev led_cdev;
-struct pardevice *pdev;
+static struct led_dev *led_devs[LED_MAX_PORTS];    /* Indexed by minor */
+static DEFINE_MUTEX(led_devs_lock);                 /* Protects led_devs */
+
+/* Last reference gone. The port was detached long ago */
+static void led_free(struct kref *ref)
+{
+    struct led_dev *led = container_of(ref, struct led_dev, ref);
+
+    cancel_delayed_work_sync(&led->flush_work);
+    ClearPageReserved(virt_to_page(led->state));
+    free_page((unsigned long)led->state);
+    kfree(led);
+}
 
 int led_open(struct inode *inode, struct file *file)
 {
+    struct led_dev *led;
+    struct led_file *lf;
+
+    lf = kmalloc(sizeof(struct led_file), GFP_KERNEL);
+    if (!lf) return -ENOMEM;
+
+    /* The port to be opened, if it is still there */
+    mutex_lock(&led_devs_lock);
+    led = led_devs[iminor(inode)];
+    if (led) kref_get(&led->ref);
+    mutex_unlock(&led_devs_lock);
+    if (!led) {
+        kfree(lf);
+        return -ENODEV;
+    }
+
+    /* Untimed frames until LED_IOC_TIMED says otherwise */
+    lf->led = led;
+    lf->timed = 0;
+    file->private_data = lf;
     return 0;
 }
 
-ssize_t led_write(struct file *file, const char *buf, 
+/* Write a byte to the port and remember it for the state file */
+static void led_output(struct led_dev *led, unsigned char data)
+{
+    led->data = data;
+    parport_write_data(led->pdev->port, data);
+}
+
+/* Wake up readers blocked in poll() on the state file if the output
+ * differs from old. sysfs_notify() may sleep, so this runs once a
+ * write or flush is done rather than from the playback timer */
+static void led_notify(struct led_dev *led, unsigned char old)
+{
+    if (led->data != old)
+        sysfs_notify(&led->class_dev->kobj, NULL, "state");
+}
+
+/* Playback timer. Runs once per frame with the port claimed by
+ * the writer sleeping in led_write() */
+static enum hrtimer_restart led_play_frame(struct hrtimer *timer)
+{
+    struct led_dev *led = container_of(timer, struct led_dev, timer);
+    struct led_frame *frame;
+
+    if (++led->cur_frame >= led->nr_frames) {
+        /* Sequence done, let the writer release the port */
+        wake_up_interruptible(&led->play_wait);
+        return HRTIMER_NORESTART;
+    }
+
+    frame = &led->frames[led->cur_frame];
+    led_output(led, frame->data);
+
+    hrtimer_forward_now(timer, ns_to_ktime((u64)frame->delay_us * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+/* Copy a sequence from user space into led->frames */
+static int led_get_frames(struct led_file *lf, const char *buf, int nr)
+{
+    struct led_frame *frames = lf->led->frames;
+    unsigned char chunk[64];
+    int i, j, n;
+
+    if (lf->timed) {
+        if (copy_from_user(frames, buf, nr * sizeof(struct led_frame)))
+            return -EFAULT;
+        return 0;
+    }
+
+    for (i = 0; i < nr; i += n) {
+        n = min(nr - i, (int)sizeof(chunk));
+        if (copy_from_user(chunk, buf + i, n)) return -EFAULT;
+        for (j = 0; j < n; j++) {
+            frames[i + j].data = chunk[j];
+            frames[i + j].delay_us = frame_period_us;
+        }
+    }
+    /* Don't hold the writer after the last untimed frame */
+    frames[nr - 1].delay_us = 0;
+
+    return 0;
+}
+
+/* Get the port for a writer. Returns -EAGAIN instead of sleeping
+ * if nonblock is set and another device holds the port */
+static int led_claim(struct led_dev *led, int nonblock)
+{
+    unsigned long flags;
+
+    /* Still ours from a previous sticky write? */
+    spin_lock_irqsave(&led->claim_lock, flags);
+    if (led->claimed) {
+        led->busy = 1;
+        spin_unlock_irqrestore(&led->claim_lock, flags);
+        return 0;
+    }
+    spin_unlock_irqrestore(&led->claim_lock, flags);
+
+    if (nonblock) {
+        if (parport_claim(led->pdev)) return -EAGAIN;
+    } else {
+        parport_claim_or_block(led->pdev);
+    }
+
+    spin_lock_irqsave(&led->claim_lock, flags);
+    led->claimed = led->busy = 1;
+    spin_unlock_irqrestore(&led->claim_lock, flags);
+    return 0;
+}
+
+/* Give up our claim on the port. Returns 1 if we still held it and
+ * the caller must parport_release() it, 0 if led_preempt() already
+ * let it go */
+static int led_drop_claim(struct led_dev *led)
+{
+    unsigned long flags;
+    int claimed;
+
+    spin_lock_irqsave(&led->claim_lock, flags);
+    claimed = led->claimed;
+    led->claimed = led->wanted = 0;
+    spin_unlock_irqrestore(&led->claim_lock, flags);
+    return claimed;
+}
+
+/* Done with the port. Sticky mode keeps it unless another device
+ * has been refused it meanwhile */
+static void led_unclaim(struct led_dev *led)
+{
+    unsigned long flags;
+    int keep;
+
+    spin_lock_irqsave(&led->claim_lock, flags);
+    led->busy = 0;
+    keep = led->sticky && !led->wanted;
+    spin_unlock_irqrestore(&led->claim_lock, flags);
+
+    if (!keep && led_drop_claim(led)) parport_release(led->pdev);
+}
+
+ssize_t led_write(struct file *file, const char *buf,
         size_t count, loff_t *ppop)
 {
-    char kbuf;
+    struct led_file *lf = file->private_data;
+    struct led_dev *led = lf->led;
+    size_t frame_size;
+    unsigned char old;
+    int nr, ret;
+
+    frame_size = lf->timed ? sizeof(struct led_frame) : 1;
+    nr = min(count / frame_size, (size_t)LED_MAX_FRAMES);
+    if (!nr) return -EINVAL;
+
+    if (file->f_flags & O_NONBLOCK) {
+        if (!mutex_trylock(&led->mutex)) return -EAGAIN;
+    } else if (mutex_lock_interruptible(&led->mutex)) {
+        return -ERESTARTSYS;
+    }
+    if (led->dead) {
+        ret = -ENODEV;
+        goto out_unlock;
+    }
+
+    led->frames = kmalloc(nr * sizeof(struct led_frame), GFP_KERNEL);
+    if (!led->frames) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+    if ((ret = led_get_frames(lf, buf, nr))) goto out_free;
 
-    if (copy_from_user(&kbuf, buf, 1)) return -EFAULT;
+    /* Claim the port once for the whole sequence */
+    if ((ret = led_claim(led, file->f_flags & O_NONBLOCK))) goto out_free;
 
-    /* Claim the port*/
-    parport_claim_or_block(pdev);
+    /* Write the first frame, the timer plays back the rest */
+    led->nr_frames = nr;
+    led->cur_frame = 0;
+    old = led->data;
+    led_output(led, led->frames[0].data);
+
+    ret = nr * frame_size;
+    if (nr > 1 || led->frames[0].delay_us) {
+        hrtimer_start(&led->timer,
+                ns_to_ktime((u64)led->frames[0].delay_us * NSEC_PER_USEC),
+                HRTIMER_MODE_REL);
+        wait_event_interruptible(led->play_wait,
+                led->cur_frame >= led->nr_frames || led->dead);
+        if (led->cur_frame < led->nr_frames) {
+            /* Interrupted or detached, stop the sequence where it is */
+            hrtimer_cancel(&led->timer);
+            ret = led->dead ? -ENODEV : -EINTR;
+        }
+    }
 
-    /* Write to the device */
-    parport_write_data(pdev->port, kbuf);
+    /* Release the port, or keep it in sticky mode */
+    led_unclaim(led);
+    led_notify(led, old);
 
-    /* Release the port */
-    parport_release(pdev);
+out_free:
+    kfree(led->frames);
+    led->frames = NULL;
+out_unlock:
+    mutex_unlock(&led->mutex);
 
-    return count;
+    /* Wake up pollers waiting for the port */
+    wake_up_interruptible(&led->port_wait);
+    return ret;
+}
+
+/* Push the mmap'd LED byte to the port if user space has updated it
+ * since the last flush. Runs every flush_interval_ms while the page
+ * is mapped */
+static void led_flush(struct work_struct *work)
+{
+    struct led_dev *led = container_of(work, struct led_dev, flush_work.work);
+    unsigned int seq = led->state->seq;
+    unsigned char old = led->data;
+
+    smp_rmb();
+    /* Skip this round if a write() sequence owns the port */
+    if (seq != led->flushed_seq && mutex_trylock(&led->mutex)) {
+        /* Don't sleep behind another parport user either */
+        if (!led->dead && !led_claim(led, 1)) {
+            led_output(led, led->state->data);
+            led_unclaim(led);
+            led->flushed_seq = seq;
+            led_notify(led, old);
+        }
+        mutex_unlock(&led->mutex);
+        wake_up_interruptible(&led->port_wait);
+    }
+
+    if (atomic_read(&led->map_count) && !led->dead)
+        schedule_delayed_work(&led->flush_work,
+                msecs_to_jiffies(flush_interval_ms) ? : 1);
+}
+
+static void led_vma_open(struct vm_area_struct *vma)
+{
+    struct led_dev *led = vma->vm_private_data;
+
+    /* The mapping keeps the state page. The first one starts the
+     * flush work */
+    kref_get(&led->ref);
+    if (atomic_inc_return(&led->map_count) == 1 && !led->dead)
+        schedule_delayed_work(&led->flush_work, 0);
+}
+
+static void led_vma_close(struct vm_area_struct *vma)
+{
+    struct led_dev *led = vma->vm_private_data;
+
+    /* led_flush() stops rescheduling once the last mapping is gone */
+    atomic_dec(&led->map_count);
+    kref_put(&led->ref, led_free);
+}
+
+static struct vm_operations_struct led_vm_ops = {
+    .open = led_vma_open,
+    .close = led_vma_close,
+};
+
+/* Map the LED state page into user space */
+static int led_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct led_file *lf = file->private_data;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    if (lf->led->dead) return -ENODEV;
+
+    if (remap_pfn_range(vma, vma->vm_start,
+                virt_to_phys(lf->led->state) >> PAGE_SHIFT,
+                PAGE_SIZE, vma->vm_page_prot))
+        return -EAGAIN;
+
+    vma->vm_ops = &led_vm_ops;
+    vma->vm_private_data = lf->led;
+    led_vma_open(vma);
+    return 0;
+}
+
+/* Writable once no sequence is running and the port is free or
+ * already ours */
+static unsigned int led_poll(struct file *file, poll_table *wait)
+{
+    struct led_file *lf = file->private_data;
+    struct led_dev *led = lf->led;
+
+    poll_wait(file, &led->port_wait, wait);
+
+    if (led->dead) return POLLERR | POLLHUP;
+    if (!mutex_is_locked(&led->mutex) &&
+            (led->claimed || !led->pdev->port->cad))
+        return POLLOUT | POLLWRNORM;
+    return 0;
+}
+
+static int led_ioctl(struct inode *inode, struct file *file,
+        unsigned int cmd, unsigned long arg)
+{
+    struct led_file *lf = file->private_data;
+
+    switch (cmd) {
+        case LED_IOC_TIMED:
+            /* Select the frame format of subsequent writes */
+            lf->timed = (arg != 0);
+            break;
+        case LED_IOC_STICKY:
+            /* Keep the port across writes. Turning sticky mode off
+             * gives back a port we are holding on to */
+            if (mutex_lock_interruptible(&lf->led->mutex))
+                return -ERESTARTSYS;
+            if (lf->led->dead) {
+                mutex_unlock(&lf->led->mutex);
+                return -ENODEV;
+            }
+            lf->led->sticky = (arg != 0);
+            if (!lf->led->sticky) led_unclaim(lf->led);
+            mutex_unlock(&lf->led->mutex);
+            break;
+        default:
+            return -ENOTTY;
+    }
+    return 0;
 }
 
 /* Release the device */
 int led_release(struct inode *inode, struct file *file)
 {
+    struct led_file *lf = file->private_data;
+
+    kref_put(&lf->led->ref, led_free);
+    kfree(lf);
     return 0;
 }
 
@@ -45,26 +454,162 @@ static struct file_operations led_fops = {
     .owner = THIS_MODULE,
     .open = led_open,
     .write = led_write,
+    .ioctl = led_ioctl,
+    .mmap = led_mmap,
+    .poll = led_poll,
     .release = led_release,
 };
 
+/* /sys/class/led/ledN/state, the last byte written to port N.
+ * Readers can poll() it for changes */
+static ssize_t show_state(struct class_device *class_dev, char *buf)
+{
+    struct led_dev *led = class_get_devdata(class_dev);
+
+    return sprintf(buf, "0x%02x\n", led->data);
+}
+
+static CLASS_DEVICE_ATTR(state, 0444, show_state, NULL);
+
+/* Another device wants the port. Refuse while a writer is using
+ * it; otherwise we only hold it because of sticky mode, so let it
+ * go. The parport core releases the port when we return 0 */
 static int led_preempt(void *handle)
 {
-    return 1;
+    struct led_dev *led = handle;
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&led->claim_lock, flags);
+    if (led->busy) {
+        /* Hand it over at the end of the current write */
+        led->wanted = 1;
+        ret = 1;
+    } else {
+        led->claimed = 0;
+    }
+    spin_unlock_irqrestore(&led->claim_lock, flags);
+    return ret;
+}
+
+/* The port was released by another device */
+static void led_wakeup(void *handle)
+{
+    struct led_dev *led = handle;
+
+    wake_up_interruptible(&led->port_wait);
 }
 
-/* Parport attach method */
+/* Parport attach method. Called once for every port in the system */
 static void led_attach(struct parport *port)
 {
+    struct led_dev *led;
+
+    if (port->number >= LED_MAX_PORTS) return;
+
+    /* Allocate the per-port device structure */
+    led = kzalloc(sizeof(struct led_dev), GFP_KERNEL);
+    if (!led) return;
+    led->minor = port->number;
+    kref_init(&led->ref);       /* Dropped by led_detach() */
+    mutex_init(&led->mutex);
+    spin_lock_init(&led->claim_lock);
+    init_waitqueue_head(&led->play_wait);
+    init_waitqueue_head(&led->port_wait);
+
+    /* Timer used to play back multi-frame writes */
+    hrtimer_init(&led->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    led->timer.function = led_play_frame;
+
+    /* Page shared with user space through mmap() */
+    led->state = (struct led_state *)get_zeroed_page(GFP_KERNEL);
+    if (!led->state) goto out_free;
+    SetPageReserved(virt_to_page(led->state));
+    INIT_DELAYED_WORK(&led->flush_work, led_flush);
+
     /* Register the parallel LED device with parport */
-    pdev = parport_register_device(port, DEVICE_NAME, led_preempt, NULL, NULL, 0, NULL);
-    if (pdev == NULL) printk("Bad register\n");
+    led->pdev = parport_register_device(port, DEVICE_NAME, led_preempt,
+            led_wakeup, NULL, 0, led);
+    if (led->pdev == NULL) {
+        printk("Bad register\n");
+        goto out_page;
+    }
+
+    /* Connect the file operations with the cdev */
+    cdev_init(&led->cdev, &led_fops);
+    led->cdev.owner = THIS_MODULE;
+
+    /* Connect the major/minor number to the cdev */
+    if (cdev_add(&led->cdev, dev_number + led->minor, 1)) {
+        printk("Bad cdev add\n");
+        goto out_unregister;
+    }
+
+    /* /dev/ledN for parport N */
+    led->class_dev = class_device_create(led_class, NULL,
+            dev_number + led->minor, NULL, DEVICE_NAME "%d", led->minor);
+    if (IS_ERR(led->class_dev)) {
+        printk("Bad class device\n");
+        goto out_cdev;
+    }
+    class_set_devdata(led->class_dev, led);
+    if (class_device_create_file(led->class_dev, &class_device_attr_state)) {
+        printk("Bad state file\n");
+        goto out_class;
+    }
+
+    mutex_lock(&led_devs_lock);
+    led_devs[led->minor] = led;
+    mutex_unlock(&led_devs_lock);
+    return;
+
+out_class:
+    class_device_destroy(led_class, dev_number + led->minor);
+out_cdev:
+    cdev_del(&led->cdev);
+out_unregister:
+    parport_unregister_device(led->pdev);
+out_page:
+    ClearPageReserved(virt_to_page(led->state));
+    free_page((unsigned long)led->state);
+out_free:
+    kfree(led);
 }
 
-/* Parport detach method */
+/* Parport detach method. Tear down the device of this port. Files
+ * still open or mapped keep struct led_dev, but every operation on
+ * them fails with -ENODEV from now on */
 static void led_detach(struct parport *port)
 {
-    /* do nothing */
+    struct led_dev *led;
+
+    if (port->number >= LED_MAX_PORTS) return;
+    mutex_lock(&led_devs_lock);
+    led = led_devs[port->number];
+    led_devs[port->number] = NULL;
+    mutex_unlock(&led_devs_lock);
+    if (!led) return;
+
+    cdev_del(&led->cdev);
+
+    /* Cut a running sequence short and wait for its writer to let go
+     * of the port. Writers and flushes notify the state file before
+     * they drop the mutex, so once we hold it none of them can touch
+     * the class device again */
+    led->dead = 1;
+    wake_up_interruptible(&led->play_wait);
+    mutex_lock(&led->mutex);
+    cancel_delayed_work_sync(&led->flush_work);
+    if (led_drop_claim(led)) parport_release(led->pdev);
+    parport_unregister_device(led->pdev);
+    mutex_unlock(&led->mutex);
+
+    class_device_remove_file(led->class_dev, &class_device_attr_state);
+    class_device_destroy(led_class, dev_number + led->minor);
+
+    /* Pollers see POLLHUP */
+    wake_up_interruptible(&led->port_wait);
+    kref_put(&led->ref, led_free);
 }
 
 /* Parport driver operations */
@@ -78,8 +623,9 @@ static struct parport_driver led_driver = {
 /* Driver Initialization */
 int __int led_init(void)
 {
-    /* Request dynamic allocation of a device major number */
-    if (alloc_chrdev_region(&dev_number, 0, 1, DEVICE_NAME)
+    /* Request dynamic allocation of device major number, with
+     * one minor per parallel port */
+    if (alloc_chrdev_region(&dev_number, 0, LED_MAX_PORTS, DEVICE_NAME)
             < 0) {
         printk(KERN_DEBUG "Can't register device\n");
         return -1;
@@ -89,20 +635,8 @@ int __int led_init(void)
     led_class = class_create(THIS_MODULE, DEVICE_NAME);
     if (IS_ERR(led_class)) printk("Bad class create\n");
 
-    /* Connect the file operations with the cdev */
-    cdev_init(&led_cdev, &led_fops);
-
-    led_cdev.owner = THIS_MODULE;
-
-    /* Connect the major/minor number to the cdev */
-    if (cdev_add(&led_cdev, dev_number, 1)) {
-        printk("Bad cdev add\n");
-        return 1;
-    }
-
-    class_device_create(led_class, NULL, dev_number, NULL, DEVICE_NAME);
-
-    /* Register this driver with parport */
+    /* Register this driver with parport. led_attach() creates
+     * the char device of every port */
     if (parport_register_driver(&led_driver)) {
         printk(KERN_ERR "Bad Parport Register\n");
         return -EIO;
@@ -116,9 +650,10 @@ int __int led_init(void)
 /* Driver Exit */
 void __exit led_cleanup(void)
 {
-    unregister_chrdev_region(dev_number, 1);
-    class_device_destroy(led_class, dev_number);
+    /* Calls led_detach() for every port */
+    parport_unregister_driver(&led_driver);
     class_destroy(led_class);
+    unregister_chrdev_region(dev_number, LED_MAX_PORTS);
     return;
 }
 
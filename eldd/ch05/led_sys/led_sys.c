@@ -3,6 +3,9 @@
 #include <linux/parport.h>
 #include <asm/uaccess.h>
 #include <linux/pci.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
 
 static dev_t dev_number;
 static struct class *led_class;
@@ -17,50 +20,231 @@ struct led_attr {
     ssize_t (*store)(const char *buffer, size_t count);
 }
 
+#define LED_PWM_LEVELS  16      /* Brightness steps per PWM period */
+
+static unsigned int pwm_tick_us = 500;
+module_param(pwm_tick_us, uint, 0444);
+MODULE_PARM_DESC(pwm_tick_us, "Duration of one brightness step in microseconds, at least 1");
+
+/* Shadow copy of the parport data register. Stores update it and
+ * push the result with a single parport write; shows are served
+ * from it without claiming the port */
+static unsigned char led_shadow;
+static DEFINE_MUTEX(led_shadow_lock);
+
+/* Software PWM state. LEDs in led_pwm_mask have a brightness
+ * between 0 and LED_PWM_LEVELS exclusive and are driven by one
+ * shared hrtimer. While it runs, the driver keeps the port claimed
+ * and the timer is the only one writing to it */
+static unsigned char led_brightness[8];
+static unsigned char led_pwm_mask;
+static int led_pwm_active, led_pwm_phase, led_pwm_out;
+static struct hrtimer led_pwm_timer;
+
+/* PWM tick. Computes the byte for the current phase of all LEDs,
+ * writes it once if it changed, and sleeps until the next phase at
+ * which some LED switches */
+static enum hrtimer_restart led_pwm_tick(struct hrtimer *timer)
+{
+    unsigned char out = led_shadow & ~led_pwm_mask;
+    int i, next = LED_PWM_LEVELS;
+
+    for (i = 0; i < 8; i++) {
+        if (!(led_pwm_mask & (1 << i))) continue;
+        if (led_pwm_phase < led_brightness[i]) {
+            out |= 1 << i;
+            if (led_brightness[i] < next) next = led_brightness[i];
+        }
+    }
+
+    if (out != led_pwm_out) {
+        parport_write_data(pdev->port, out);
+        led_pwm_out = out;
+    }
+
+    hrtimer_forward_now(timer, ns_to_ktime((u64)(next - led_pwm_phase) *
+                pwm_tick_us * NSEC_PER_USEC));
+    led_pwm_phase = next % LED_PWM_LEVELS;
+    return HRTIMER_RESTART;
+}
+
+/* Wake up readers blocked in poll() on the ledN files of the LEDs
+ * in changed, and on the brightnessN files of the LEDs in dimmed */
+static void led_notify(unsigned char changed, unsigned char dimmed)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        if (changed & (1 << i)) {
+            sprintf(name, "led%d", i);
+            sysfs_notify(&kobj, NULL, name);
+        }
+        if (dimmed & (1 << i)) {
+            sprintf(name, "brightness%d", i);
+            sysfs_notify(&kobj, NULL, name);
+        }
+    }
+    if (changed) sysfs_notify(&kobj, NULL, "mask");
+}
+
+/* Replace the bits in mask with those in value and write the
+ * new byte to the port if anything changed. LEDs in mask go back
+ * to plain on/off */
+static void led_update(unsigned char mask, unsigned char value)
+{
+    unsigned char buf, changed, dimmed = 0;
+    int i, level;
+
+    mutex_lock(&led_shadow_lock);
+    buf = (led_shadow & ~mask) | (value & mask);
+    changed = buf ^ led_shadow;
+    for (i = 0; i < 8; i++) {
+        if (!(mask & (1 << i))) continue;
+        level = (buf & (1 << i)) ? LED_PWM_LEVELS : 0;
+        if (led_brightness[i] != level) dimmed |= 1 << i;
+        led_brightness[i] = level;
+    }
+    led_pwm_mask &= ~mask;
+
+    if (led_pwm_active && !led_pwm_mask) {
+        /* No LED left at partial brightness, stop the PWM tick */
+        hrtimer_cancel(&led_pwm_timer);
+        led_pwm_active = 0;
+        led_shadow = buf;
+        parport_write_data(pdev->port, buf);
+        parport_release(pdev);
+    } else if (led_pwm_active) {
+        /* The PWM tick owns the port and picks up the new byte */
+        led_shadow = buf;
+    } else if (buf != led_shadow) {
+        led_shadow = buf;
+        parport_claim_or_block(pdev);
+        parport_write_data(pdev->port, buf);
+        parport_release(pdev);
+    }
+    mutex_unlock(&led_shadow_lock);
+
+    led_notify(changed, dimmed);
+}
+
+/* Set the brightness of one LED, 0 to LED_PWM_LEVELS */
+static void led_set_brightness(int number, int level)
+{
+    unsigned char changed, dimmed;
+
+    if (level <= 0 || level >= LED_PWM_LEVELS) {
+        led_update(1 << number, level > 0 ? 0xFF : 0);
+        return;
+    }
+
+    mutex_lock(&led_shadow_lock);
+    changed = ~led_shadow & (1 << number);
+    dimmed = led_brightness[number] != level ? 1 << number : 0;
+    led_brightness[number] = level;
+    led_shadow |= 1 << number;
+    led_pwm_mask |= 1 << number;
+    if (!led_pwm_active) {
+        /* Hold the port for as long as the PWM tick runs */
+        parport_claim_or_block(pdev);
+        led_pwm_active = 1;
+        led_pwm_phase = 0;
+        led_pwm_out = -1;
+        hrtimer_start(&led_pwm_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+    }
+    mutex_unlock(&led_shadow_lock);
+
+    led_notify(changed, dimmed);
+}
+
 #define glow_show_led(number)	\
 static ssize_t	\
 glow_led_##number(const char *buffer, size_t count)	\
 {	\
-    unsigned char buf;	\
     int value;	\
 	\
-    sscanf(buffer, "%d", &value);	\
+    if (sscanf(buffer, "%d", &value) != 1) return -EINVAL;	\
 	\
-    parport_claim_or_block(pdev);	\
-    buf = parport_read_data(pdev->port);	\
-    if (value) {	\
-        parport_write_data(pdev->port, buf | (1<<number));	\
-    } else {	\
-        parport_write_data(pdev->port, buf & ~(1<<number));	\
-    }	\
-    parport_release(pdev);	\
+    led_update(1 << number, value ? 0xFF : 0);	\
     return count;	\
 }	\
 	\
 static ssize_t	\
 show_led_##number(char *buffer)	\
 {	\
-    unsigned char buf;	\
-	\
-    parport_claim_or_block(pdev);	\
-	\
-    buf = parport_read_data(pdev->port);	\
-    parport_release(pdev);	\
-	\
-    if (buf & (1 << number)) {	\
+    if (led_shadow & (1 << number)) {	\
         return sprintf(buffer, "ON\n");	\
     } else {	\
         return sprintf(buffer, "OFF\n");	\
     }	\
 }	\
 	\
+static ssize_t	\
+dim_led_##number(const char *buffer, size_t count)	\
+{	\
+    int value;	\
+	\
+    if (sscanf(buffer, "%d", &value) != 1) return -EINVAL;	\
+	\
+    led_set_brightness(number, value);	\
+    return count;	\
+}	\
+	\
+static ssize_t	\
+show_brightness_##number(char *buffer)	\
+{	\
+    return sprintf(buffer, "%d\n", led_brightness[number]);	\
+}	\
+	\
 static struct led_attr led##number = 	\
-__ATTR(led##number, 0644, show_led_##number, glow_led_##number);
+__ATTR(led##number, 0644, show_led_##number, glow_led_##number);	\
+	\
+static struct led_attr brightness##number = 	\
+__ATTR(brightness##number, 0644, show_brightness_##number, dim_led_##number);
 
 glow_show_led(0); glow_show_led(1); glow_show_led(2);
 glow_show_led(3); glow_show_led(4); glow_show_led(5);
 glow_show_led(6); glow_show_led(7);
 
+/* Set all 8 LEDs at once. Accepts a number such as 0xA5 */
+static ssize_t store_mask(const char *buffer, size_t count)
+{
+    led_update(0xFF, simple_strtoul(buffer, NULL, 0));
+    return count;
+}
+
+static ssize_t show_mask(char *buffer)
+{
+    return sprintf(buffer, "0x%02x\n", led_shadow);
+}
+
+static struct led_attr mask =
+__ATTR(mask, 0644, show_mask, store_mask);
+
+/* Binary flavour of the mask attribute, a single raw byte */
+static ssize_t read_mask_bin(struct kobject *kobj, char *buffer,
+        loff_t off, size_t count)
+{
+    if (off || !count) return 0;
+    buffer[0] = led_shadow;
+    return 1;
+}
+
+static ssize_t write_mask_bin(struct kobject *kobj, char *buffer,
+        loff_t off, size_t count)
+{
+    if (off || !count) return -EINVAL;
+    led_update(0xFF, buffer[0]);
+    return count;
+}
+
+static struct bin_attribute mask_bin = {
+    .attr   =   { .name = "mask_bin", .mode = 0644, .owner = THIS_MODULE },
+    .size   =   1,
+    .read   =   read_mask_bin,
+    .write  =   write_mask_bin,
+};
+
 
 #define DEVICE_NAME "led"
 
@@ -72,8 +256,20 @@ static int led_preempt(void *handle)
 /* Parport attach method */
 static void led_attach(struct parport *port)
 {
+    int i;
+
     pdev = parport_register_device(port, DEVICE_NAME, led_preempt, NULL, NULL, 0, NULL);
-    if (pdev == NULL) printk("Bad register\n");
+    if (pdev == NULL) {
+        printk("Bad register\n");
+        return;
+    }
+
+    /* Seed the shadow register from the hardware, once */
+    parport_claim_or_block(pdev);
+    led_shadow = parport_read_data(pdev->port);
+    parport_release(pdev);
+    for (i = 0; i < 8; i++)
+        led_brightness[i] = (led_shadow & (1 << i)) ? LED_PWM_LEVELS : 0;
 }
 
 /* Parent sysfs show() method. Calls the show() method 
@@ -107,7 +303,9 @@ static struct sysfs_ops sysfs_ops = {
 
 /* Attributes of the /sys/class/pardevice/led/control/ kobject. 
  * Each file in this directory corresponds to one LED. Control 
- * each LED by writing or reading the associated sysfs file */
+ * each LED by writing or reading the associated sysfs file.
+ * The brightnessN files dim LED N in LED_PWM_LEVELS steps, and
+ * the mask file controls all 8 LEDs with one write */
 static struct attribute *led_atrrs[] = {
     &led0.attr,
     &led1.attr,
@@ -117,11 +315,20 @@ static struct attribute *led_atrrs[] = {
     &led5.attr,
     &led6.attr,
     &led7.attr,
+    &brightness0.attr,
+    &brightness1.attr,
+    &brightness2.attr,
+    &brightness3.attr,
+    &brightness4.attr,
+    &brightness5.attr,
+    &brightness6.attr,
+    &brightness7.attr,
+    &mask.attr,
     NULL
 };
 
-/* This describes the kobject. The kobject has 8 files, one
- * corresponding to each LED. This representation is called the
+/* This describes the kobject. The kobject has 2 files for each
+ * LED, plus the mask file. This representation is called the
  * ktype of the kobject */
 static struct kobj_type ktype_led = {
     .sysfs_ops     =   &sysfs_ops,
@@ -138,6 +345,13 @@ static struct parport_driver led_driver = {
 int __init led_init(void)
 {
     struct class_device *c_d;
+
+    /* A zero tick would re-arm the PWM timer back to back */
+    if (!pwm_tick_us) {
+        printk(KERN_ERR "pwm_tick_us must be at least 1\n");
+        return -EINVAL;
+    }
+
     if Calloc_chrdev_region(&dev_number, 01, DEVICE_NAME<0) {
         printk(KERN_DEBUG "Can't register device\n");
         return -1;
@@ -151,6 +365,10 @@ int __init led_init(void)
     c_d = class_device_create(led_class, NULL, dev_number,
             NULL, DEVICE_NAME);
 
+    /* Shared tick for the software PWM */
+    hrtimer_init(&led_pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    led_pwm_timer.function = led_pwm_tick;
+
     /* Register this driver with parport */
     if (parport_register_driver(&led_driver)) {
         printk(KERN_ERR "Bad parport register\n");
@@ -173,6 +391,9 @@ int __init led_init(void)
     /* Register the kobject */
     kobject_register(&kobj);
 
+    /* /sys/class/pardevice/led/control/mask_bin */
+    sysfs_create_bin_file(&kobj, &mask_bin);
+
     printk("LED Driver Initialized.\n");
     return 0;
 }
@@ -180,6 +401,14 @@ int __init led_init(void)
 /* Driver Exit */
 void led_cleanup(void)
 {
+    sysfs_remove_bin_file(&kobj, &mask_bin);
+
+    /* Stop the PWM tick and give the port back */
+    if (led_pwm_active) {
+        hrtimer_cancel(&led_pwm_timer);
+        parport_release(pdev);
+    }
+
     /* Unregister kobject corresponding to 
        /sys/class/pardevice/led/control */
     kobject_unregister(&kobj);
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/* LED driver benchmark. Run with parport_emu loaded, then led.c or
+ * led_sys.c attached to the emulated port:
+ *
+ * led_bench [iterations] [char device] [sysfs file]
+ *
+ * Reports writes/sec and p50/p99 write latency for the char device
+ * and sysfs paths, the parport data register accesses each write
+ * cost, and the raw claim/release cost measured by parport_emu */
+
+#define EMU_SYSFS   "/sys/devices/platform/parport_emu/"
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Read a number from a parport_emu sysfs file */
+static long emu_read(const char *name)
+{
+    char path[128], buffer[32];
+    int fd, n;
+
+    snprintf(path, sizeof(path), EMU_SYSFS "%s", name);
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+    n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buffer[n] = '\0';
+    return atol(buffer);
+}
+
+/* Write a string to a parport_emu sysfs file. Returns -1 and
+ * reports the failure if it didn't take */
+static int emu_write(const char *name, const char *value)
+{
+    char path[128];
+    int fd, ret = 0;
+
+    snprintf(path, sizeof(path), EMU_SYSFS "%s", name);
+    if ((fd = open(path, O_WRONLY)) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (write(fd, value, strlen(value)) != (ssize_t)strlen(value)) {
+        perror(path);
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Time iterations writes to path and print the statistics. sysfs
+ * files take "0"/"1", the char device takes a raw byte */
+static void bench(const char *label, const char *path, int sysfs,
+        int iterations)
+{
+    long long *lat, start, t;
+    long writes, reads;
+    char buffer[2];
+    int fd, i, counted = 0;
+
+    if ((fd = open(path, O_WRONLY)) < 0) {
+        perror(path);
+        return;
+    }
+    lat = malloc(iterations * sizeof(*lat));
+
+    /* Without a clean start the per-op figures are meaningless */
+    if (emu_write("data_writes", "0") || emu_write("data_reads", "0"))
+        fprintf(stderr, "%s: counters not reset, bus figures skipped\n",
+                label);
+    else
+        counted = 1;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (sysfs) {
+            buffer[0] = (i & 1) ? '1' : '0';
+        } else {
+            buffer[0] = (i & 1) ? 0xFF : 0x00;
+        }
+        t = now_ns();
+        if (pwrite(fd, buffer, 1, 0) != 1) {
+            perror("write");
+            break;
+        }
+        lat[i] = now_ns() - t;
+    }
+    t = now_ns() - start;
+    close(fd);
+
+    writes = emu_read("data_writes");
+    reads = emu_read("data_reads");
+
+    if (i) {
+        qsort(lat, i, sizeof(*lat), cmp_ns);
+        printf("%-6s %10.0f writes/sec  p50 %7lld ns  p99 %7lld ns",
+                label, i * 1e9 / t, lat[i / 2], lat[i * 99 / 100]);
+        if (counted && writes >= 0)
+            printf("  bus %.2f writes %.2f reads per op",
+                    (double)writes / i, (double)reads / i);
+        printf("\n");
+    }
+    free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    const char *chardev = argc > 2 ? argv[2] : "/dev/led0";
+    const char *sysfs = argc > 3 ? argv[3] :
+        "/sys/class/pardevice/led/control/led0";
+    char buffer[16];
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations] [char device] [sysfs file]\n",
+                argv[0]);
+        exit(-1);
+    }
+
+    bench("char", chardev, 0, iterations);
+    bench("sysfs", sysfs, 1, iterations);
+
+    /* Ask parport_emu to time bare claim/release cycles */
+    snprintf(buffer, sizeof(buffer), "%d", iterations);
+    if (!emu_write("claim_bench", buffer))
+        printf("claim/release %ld ns\n", emu_read("claim_bench"));
+
+    return 0;
+}
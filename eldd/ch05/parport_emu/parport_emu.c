@@ -0,0 +1,277 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/parport.h>
+#include <linux/platform_device.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <asm/atomic.h>
+
+/* RAM-backed stand-in for a parallel port. Registers nr_ports ports
+ * with the parport core, so drivers such as led.c and led_sys.c
+ * attach to them as they would to real hardware. Register accesses
+ * are counted and exported through sysfs:
+ *
+ * /sys/devices/platform/parport_emu/data_reads   Data register reads
+ * /sys/devices/platform/parport_emu/data_writes  Data register writes
+ * /sys/devices/platform/parport_emu/claim_bench  Write N to time N
+ *                                                claim/release cycles,
+ *                                                read the ns per cycle
+ *
+ * Writing 0 to data_reads or data_writes resets the counter */
+
+#define EMU_MAX_PORTS   4
+#define EMU_BENCH_MAX   100000  /* Most cycles per claim_bench write */
+
+static int nr_ports = 1;
+module_param(nr_ports, int, 0444);
+MODULE_PARM_DESC(nr_ports, "Number of emulated parallel ports");
+
+/* Register file of one emulated port */
+struct emu_regs {
+    unsigned char data;
+    unsigned char control;
+    unsigned char status;
+};
+
+static struct parport *emu_ports[EMU_MAX_PORTS];
+static struct emu_regs emu_regs[EMU_MAX_PORTS];
+static atomic_t emu_data_reads = ATOMIC_INIT(0);
+static atomic_t emu_data_writes = ATOMIC_INIT(0);
+static unsigned long emu_claim_ns;         /* Last claim_bench result */
+static struct platform_device *emu_dev;    /* Device structure */
+
+/* Register accessors. Each one works on the port's RAM copy */
+static void emu_write_data(struct parport *p, unsigned char d)
+{
+    ((struct emu_regs *)p->private_data)->data = d;
+    atomic_inc(&emu_data_writes);
+}
+
+static unsigned char emu_read_data(struct parport *p)
+{
+    atomic_inc(&emu_data_reads);
+    return ((struct emu_regs *)p->private_data)->data;
+}
+
+static void emu_write_control(struct parport *p, unsigned char d)
+{
+    ((struct emu_regs *)p->private_data)->control = d;
+}
+
+static unsigned char emu_read_control(struct parport *p)
+{
+    return ((struct emu_regs *)p->private_data)->control;
+}
+
+static unsigned char emu_frob_control(struct parport *p, unsigned char mask,
+        unsigned char val)
+{
+    struct emu_regs *regs = p->private_data;
+
+    regs->control = (regs->control & ~mask) ^ val;
+    return regs->control;
+}
+
+static unsigned char emu_read_status(struct parport *p)
+{
+    return ((struct emu_regs *)p->private_data)->status;
+}
+
+/* Nothing to do for the remaining hardware hooks */
+static void emu_nop(struct parport *p)
+{
+}
+
+static void emu_init_state(struct pardevice *dev, struct parport_state *s)
+{
+}
+
+static void emu_save_state(struct parport *p, struct parport_state *s)
+{
+}
+
+static void emu_restore_state(struct parport *p, struct parport_state *s)
+{
+}
+
+/* Port operations. Transfers use the generic IEEE 1284 helpers,
+ * which are built on the accessors above */
+static struct parport_operations emu_ops = {
+    .write_data     =   emu_write_data,
+    .read_data      =   emu_read_data,
+    .write_control  =   emu_write_control,
+    .read_control   =   emu_read_control,
+    .frob_control   =   emu_frob_control,
+    .read_status    =   emu_read_status,
+    .enable_irq     =   emu_nop,
+    .disable_irq    =   emu_nop,
+    .data_forward   =   emu_nop,
+    .data_reverse   =   emu_nop,
+    .init_state     =   emu_init_state,
+    .save_state     =   emu_save_state,
+    .restore_state  =   emu_restore_state,
+    .epp_write_data =   parport_ieee1284_epp_write_data,
+    .epp_read_data  =   parport_ieee1284_epp_read_data,
+    .epp_write_addr =   parport_ieee1284_epp_write_addr,
+    .epp_read_addr  =   parport_ieee1284_epp_read_addr,
+    .ecp_write_data =   parport_ieee1284_ecp_write_data,
+    .ecp_read_data  =   parport_ieee1284_ecp_read_data,
+    .ecp_write_addr =   parport_ieee1284_ecp_write_addr,
+    .compat_write_data  =   parport_ieee1284_write_compat,
+    .nibble_read_data   =   parport_ieee1284_read_nibble,
+    .byte_read_data     =   parport_ieee1284_read_byte,
+    .owner          =   THIS_MODULE,
+};
+
+/* Sysfs methods for the access counters */
+static ssize_t show_data_reads(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    return sprintf(buffer, "%d\n", atomic_read(&emu_data_reads));
+}
+
+static ssize_t reset_data_reads(struct device *dev,
+        struct device_attribute *attr, const char *buffer, size_t count)
+{
+    atomic_set(&emu_data_reads, 0);
+    return count;
+}
+
+static ssize_t show_data_writes(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    return sprintf(buffer, "%d\n", atomic_read(&emu_data_writes));
+}
+
+static ssize_t reset_data_writes(struct device *dev,
+        struct device_attribute *attr, const char *buffer, size_t count)
+{
+    atomic_set(&emu_data_writes, 0);
+    return count;
+}
+
+/* Time N claim/release cycles of an idle port through a pardevice
+ * of our own. This is the overhead a driver pays per write when it
+ * claims and releases the port around every access. At most
+ * EMU_BENCH_MAX cycles, so the store returns promptly. Fails with
+ * -EBUSY rather than wait behind a driver that holds the port, as
+ * led_sys does while PWM runs */
+static ssize_t run_claim_bench(struct device *dev,
+        struct device_attribute *attr, const char *buffer, size_t count)
+{
+    struct pardevice *pd;
+    ktime_t start;
+    int i, n;
+
+    if (sscanf(buffer, "%d", &n) != 1 || n <= 0 || n > EMU_BENCH_MAX)
+        return -EINVAL;
+
+    pd = parport_register_device(emu_ports[0], "parport_emu_bench",
+            NULL, NULL, NULL, 0, NULL);
+    if (!pd) return -EBUSY;
+
+    start = ktime_get();
+    for (i = 0; i < n; i++) {
+        if (parport_claim(pd)) {
+            parport_unregister_device(pd);
+            return -EBUSY;
+        }
+        parport_release(pd);
+    }
+    emu_claim_ns = (unsigned long)
+        (ktime_to_ns(ktime_sub(ktime_get(), start)) / n);
+
+    parport_unregister_device(pd);
+    return count;
+}
+
+static ssize_t show_claim_bench(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    return sprintf(buffer, "%lu\n", emu_claim_ns);
+}
+
+DEVICE_ATTR(data_reads, 0644, show_data_reads, reset_data_reads);
+DEVICE_ATTR(data_writes, 0644, show_data_writes, reset_data_writes);
+DEVICE_ATTR(claim_bench, 0644, show_claim_bench, run_claim_bench);
+
+/* Attribute Descriptor */
+static struct attribute *emu_attrs[] = {
+    &dev_attr_data_reads.attr,
+    &dev_attr_data_writes.attr,
+    &dev_attr_claim_bench.attr,
+    NULL
+};
+
+/* Attribute group */
+static struct attribute_group emu_attr_group = {
+    .attrs = emu_attrs,
+};
+
+static void emu_remove_ports(void)
+{
+    int i;
+
+    for (i = 0; i < EMU_MAX_PORTS; i++) {
+        if (!emu_ports[i]) continue;
+        parport_remove_port(emu_ports[i]);
+        parport_put_port(emu_ports[i]);
+        emu_ports[i] = NULL;
+    }
+}
+
+/* Driver Initialization */
+int __init emu_init(void)
+{
+    struct parport *p;
+    int i;
+
+    if (nr_ports < 1 || nr_ports > EMU_MAX_PORTS) return -EINVAL;
+
+    /* Register a platform device to hang the counters off */
+    emu_dev = platform_device_register_simple("parport_emu", -1, NULL, 0);
+    if (IS_ERR(emu_dev)) {
+        printk("emu_init: error\n");
+        return PTR_ERR(emu_dev);
+    }
+    sysfs_create_group(&emu_dev->dev.kobj, &emu_attr_group);
+
+    for (i = 0; i < nr_ports; i++) {
+        /* No I/O region, IRQ or DMA behind this port */
+        p = parport_register_port(0, PARPORT_IRQ_NONE, PARPORT_DMA_NONE,
+                &emu_ops);
+        if (!p) {
+            printk(KERN_ERR "Bad parport_register_port\n");
+            emu_remove_ports();
+            sysfs_remove_group(&emu_dev->dev.kobj, &emu_attr_group);
+            platform_device_unregister(emu_dev);
+            return -ENOMEM;
+        }
+        p->private_data = &emu_regs[i];
+        p->modes = PARPORT_MODE_PCSPP;
+        emu_ports[i] = p;
+
+        /* Let parport drivers attach to the new port */
+        parport_announce_port(p);
+    }
+
+    printk("Parport Emulator Initialized with %d ports.\n", nr_ports);
+    return 0;
+}
+
+/* Driver Exit */
+void emu_cleanup(void)
+{
+    /* Detaches all parport drivers from our ports */
+    emu_remove_ports();
+
+    /* Cleanup sysfs node */
+    sysfs_remove_group(&emu_dev->dev.kobj, &emu_attr_group);
+
+    platform_device_unregister(emu_dev);
+}
+
+module_init(emu_init);
+module_exit(emu_cleanup);
+
+MODULE_LICENSE("GPL");
@@ -1,11 +1,156 @@
 #include <linux/miscdevice.h>
 #include <linux/watchdog.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
 
 #define DEFAULT_WATCHDOG_TIMEOUT    10
 #define TIMEOUT_SHIFT   5
 
 #define WENABLE_SHIFT   3
 
+/* Client deadlines live on a timing wheel of WHEEL_SLOTS ticks of
+ * sample_ms each, which bounds the longest client timeout */
+#define WHEEL_SLOTS     256
+
+/* Power-of-two millisecond buckets of the margin histograms */
+#define MARGIN_BUCKETS  16
+
+/* Page shared with applications through mmap(). An application pets
+ * the dog by atomically incrementing heartbeat, with no system call.
+ * my_wdt_timer samples the counter every sample_ms and counts it as
+ * a pet of the client that mapped the page only if it has advanced
+ * since the previous sample */
+struct my_wdt_page {
+    unsigned long heartbeat;
+};
+
+/* Every open file descriptor is a client with its own timeout. The
+ * hardware is serviced only while no client has missed its deadline */
+struct my_wdt_client {
+    unsigned long deadline;     /* Tick at which the client expires */
+    ktime_t expires;            /* Same deadline, for the statistics */
+    unsigned int timeout;       /* Seconds, set by WDIOC_SETTIMEOUT */
+};
+
+/* Histogram of the margin left before a deadline when it was met.
+ * Bucket 0 counts margins below 1 ms, bucket n those from 2^(n-1)
+ * up to 2^n ms, and the last bucket everything above. Missed
+ * deadlines are counted separately */
+struct my_wdt_hist {
+    unsigned int bucket[MARGIN_BUCKETS];
+    unsigned int missed;
+};
+
+static unsigned int sample_ms = 1000;
+module_param(sample_ms, uint, 0444);
+MODULE_PARM_DESC(sample_ms, "Heartbeat sampling period in ms, 1 up to below the timeout");
+
+static struct my_wdt_page *my_wdt_page;
+static struct my_wdt_client *my_wdt_page_owner; /* Client that mapped it */
+static unsigned long my_wdt_last_beat;
+static struct hrtimer my_wdt_timer;
+
+/* Timing wheel. wheel[t % WHEEL_SLOTS] counts the clients whose
+ * deadline is tick t. When the timer reaches a slot, its clients
+ * move to my_wdt_expired, so both a pet and a check are O(1) no
+ * matter how many clients there are */
+static DEFINE_SPINLOCK(my_wdt_lock);
+static unsigned int my_wdt_wheel[WHEEL_SLOTS];
+static unsigned long my_wdt_now;        /* Current tick */
+static unsigned int my_wdt_expired;     /* Clients past their deadline */
+static unsigned int my_wdt_clients;     /* Registered clients */
+
+/* Held across the first open and the last close, so enabling and
+ * disabling the hardware can't interleave */
+static DEFINE_MUTEX(my_wdt_mutex);
+
+/* Pet-to-deadline margins of the clients, and service-to-deadline
+ * margins of the hardware, exported through debugfs. They show how
+ * much slack the timeouts leave on a loaded host */
+static struct my_wdt_hist my_wdt_pet_hist, my_wdt_service_hist;
+static ktime_t my_wdt_hw_expires;       /* Hardware deadline */
+static struct dentry *my_wdt_debugfs;
+
+/* Emulated watchdog hardware, for hosts without the target SoC. The
+ * countdown is an hrtimer, and an expiry is a simulated reset: a log
+ * entry and a count in debugfs instead of a reboot. Build with
+ * ccflags-y += -DMY_WDT_EMULATE in the Kbuild file to select it */
+#ifdef MY_WDT_EMULATE
+static struct hrtimer my_wdt_emu_timer;
+static u32 my_wdt_emu_resets;
+
+static enum hrtimer_restart my_wdt_emu_expire(struct hrtimer *timer)
+{
+    my_wdt_emu_resets++;
+    printk(KERN_CRIT "my_wdt: watchdog expired, simulated reset %u\n",
+            my_wdt_emu_resets);
+
+    /* Keep counting down as the rebooted hardware would */
+    hrtimer_forward_now(timer, ktime_set(DEFAULT_WATCHDOG_TIMEOUT, 0));
+    return HRTIMER_RESTART;
+}
+#endif
+
+/* Add the margin left before deadline to a histogram */
+static void my_wdt_hist_add(struct my_wdt_hist *hist, ktime_t deadline)
+{
+    s64 us = ktime_to_us(ktime_sub(deadline, ktime_get()));
+    int i = 0;
+
+    if (us < 0) {
+        hist->missed++;
+        return;
+    }
+    while (i < MARGIN_BUCKETS - 1 && us >= (1000LL << i)) i++;
+    hist->bucket[i]++;
+}
+
+/* Hardware access. These are the only places that touch the
+ * watchdog registers */
+static void my_wdt_hw_enable(void)
+{
+    my_wdt_hw_expires = ktime_add(ktime_get(),
+            ktime_set(DEFAULT_WATCHDOG_TIMEOUT, 0));
+#ifdef MY_WDT_EMULATE
+    hrtimer_start(&my_wdt_emu_timer, ktime_set(DEFAULT_WATCHDOG_TIMEOUT, 0),
+            HRTIMER_MODE_REL);
+#else
+    /* Set the timeout and enable the watchdog */
+    WD_CONTROL_REGISTER |= DEFAULT_WATCHDOG_TIMEOUT << TIMEOUT_SHIFT;
+    WD_CONTROL_REGISTER |= 1 << WENABLE_SHIFT;
+#endif
+}
+
+static void my_wdt_hw_disable(void)
+{
+#ifdef MY_WDT_EMULATE
+    hrtimer_cancel(&my_wdt_emu_timer);
+#else
+    WD_CONTROL_REGISTER &= ~(1 << WENABLE_SHIFT);
+#endif
+}
+
+static void my_wdt_hw_service(void)
+{
+    my_wdt_hist_add(&my_wdt_service_hist, my_wdt_hw_expires);
+    my_wdt_hw_expires = ktime_add(ktime_get(),
+            ktime_set(DEFAULT_WATCHDOG_TIMEOUT, 0));
+#ifdef MY_WDT_EMULATE
+    hrtimer_start(&my_wdt_emu_timer, ktime_set(DEFAULT_WATCHDOG_TIMEOUT, 0),
+            HRTIMER_MODE_REL);
+#else
+    /* Pet the dog by writing a specified squence of bytes to
+     * the watchdog service register */
+    WD_SERVICE_REGISTER = 0xABCD;
+#endif
+}
+
 /* Misc structure */
 static struct miscdevice my_wdt_dev = {
     .minor = WATCHDOG_MINOR,
@@ -19,35 +164,165 @@ struct file_operations my_wdt_dog = {
     .open = my_wdt_open,
     .release = my_wdt_close,
     .write = my_wdt_write,
-    .ioctl = my_wdt_ioctl
+    .ioctl = my_wdt_ioctl,
+    .mmap = my_wdt_mmap
 };
 
 /* Module Initializtion */
 static int __init my_wdt_init(void)
 {
+    int err;
+
     /* ... */
-    misc_register(&my_wdt_dev);
+    /* The hardware is serviced from the sampling timer, so a sample
+     * has to come round well within its timeout */
+    if (!sample_ms || sample_ms >= DEFAULT_WATCHDOG_TIMEOUT * 1000) {
+        printk("my_wdt: sample_ms must be between 1 and %d\n",
+                DEFAULT_WATCHDOG_TIMEOUT * 1000 - 1);
+        return -EINVAL;
+    }
+
+    /* Heartbeat page and the timer that drives the wheel */
+    my_wdt_page = (struct my_wdt_page *)get_zeroed_page(GFP_KERNEL);
+    if (!my_wdt_page) return -ENOMEM;
+    SetPageReserved(virt_to_page(my_wdt_page));
+    hrtimer_init(&my_wdt_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    my_wdt_timer.function = my_wdt_sample;
+#ifdef MY_WDT_EMULATE
+    hrtimer_init(&my_wdt_emu_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    my_wdt_emu_timer.function = my_wdt_emu_expire;
+#endif
+
+    /* /sys/kernel/debug/my_wdt/ */
+    my_wdt_debugfs = debugfs_create_dir("my_wdt", NULL);
+    debugfs_create_file("pet_margin", 0644, my_wdt_debugfs,
+            &my_wdt_pet_hist, &my_wdt_hist_fops);
+    debugfs_create_file("service_margin", 0644, my_wdt_debugfs,
+            &my_wdt_service_hist, &my_wdt_hist_fops);
+#ifdef MY_WDT_EMULATE
+    debugfs_create_u32("resets", 0444, my_wdt_debugfs, &my_wdt_emu_resets);
+#endif
+
+    if ((err = misc_register(&my_wdt_dev))) {
+        debugfs_remove_recursive(my_wdt_debugfs);
+        ClearPageReserved(virt_to_page(my_wdt_page));
+        free_page((unsigned long)my_wdt_page);
+        return err;
+    }
     /* ... */
+    return 0;
 }
 
-/* Open watchdog */
-static void my_wdt_open(struct inode *inode, struct file *file)
+/* Convert a timeout in seconds to wheel ticks */
+static unsigned long my_wdt_ticks(unsigned int timeout)
 {
-    /* Set the timeout and enable the watchdog */
-    WD_CONTROL_REGISTER |= DEFAULT_WATCHDOG_TIMEOUT << TIMEOUT_SHIFT;
-    WD_CONTROL_REGISTER |= 1 << WENABLE_SHIFT;
+    unsigned long ticks = timeout * 1000UL / sample_ms;
+
+    return clamp(ticks, 1UL, WHEEL_SLOTS - 1UL);
+}
+
+/* Take a client off the wheel. Called with my_wdt_lock held */
+static void my_wdt_unlink(struct my_wdt_client *client)
+{
+    if ((long)(client->deadline - my_wdt_now) > 0) {
+        my_wdt_wheel[client->deadline % WHEEL_SLOTS]--;
+    } else {
+        my_wdt_expired--;
+    }
+}
+
+/* Push the deadline of a client out by its timeout. Called with
+ * my_wdt_lock held */
+static void my_wdt_link(struct my_wdt_client *client)
+{
+    unsigned long ticks = my_wdt_ticks(client->timeout);
+
+    client->deadline = my_wdt_now + ticks;
+    client->expires = ktime_add_ns(ktime_get(),
+            (u64)ticks * sample_ms * NSEC_PER_MSEC);
+    my_wdt_wheel[client->deadline % WHEEL_SLOTS]++;
+}
+
+/* Pet the dog on behalf of one client. Called with my_wdt_lock held */
+static void my_wdt_pet_locked(struct my_wdt_client *client)
+{
+    my_wdt_hist_add(&my_wdt_pet_hist, client->expires);
+    my_wdt_unlink(client);
+    my_wdt_link(client);
+}
+
+static void my_wdt_pet(struct my_wdt_client *client)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&my_wdt_lock, flags);
+    my_wdt_pet_locked(client);
+    spin_unlock_irqrestore(&my_wdt_lock, flags);
 }
 
-/* Close watchdog */
+/* Open watchdog. Registers a new client */
+static int my_wdt_open(struct inode *inode, struct file *file)
+{
+    struct my_wdt_client *client;
+    unsigned long flags;
+    int first;
+
+    client = kmalloc(sizeof(struct my_wdt_client), GFP_KERNEL);
+    if (!client) return -ENOMEM;
+    client->timeout = DEFAULT_WATCHDOG_TIMEOUT;
+    file->private_data = client;
+
+    mutex_lock(&my_wdt_mutex);
+    spin_lock_irqsave(&my_wdt_lock, flags);
+    my_wdt_link(client);
+    first = (my_wdt_clients++ == 0);
+    spin_unlock_irqrestore(&my_wdt_lock, flags);
+
+    if (first) {
+        /* Set the timeout and enable the watchdog */
+        my_wdt_hw_enable();
+
+        /* Start servicing it on behalf of the clients */
+        hrtimer_start(&my_wdt_timer,
+                ns_to_ktime((u64)sample_ms * NSEC_PER_MSEC),
+                HRTIMER_MODE_REL);
+    }
+    mutex_unlock(&my_wdt_mutex);
+    return 0;
+}
+
+/* Close watchdog. Unregisters the client */
 static int my_wdt_close(struct inode *inode, struct file *file)
 {
+    struct my_wdt_client *client = file->private_data;
+    unsigned long flags;
+    int last;
+
+    mutex_lock(&my_wdt_mutex);
+    spin_lock_irqsave(&my_wdt_lock, flags);
+    if (my_wdt_page_owner == client) my_wdt_page_owner = NULL;
+    my_wdt_unlink(client);
     /* If CONFIG_WATCHDOG_NOWAYOUT is chosen during kernel
-     * configuration, do not disable the watchdog even if the 
-     * application desires to close it */
+     * configuration, do not disable the watchdog even if the
+     * application desires to close it. The client stays counted
+     * as expired, so the hardware is no longer serviced */
+#ifdef CONFIG_WATCHDOG_NOWAYOUT
+    my_wdt_expired++;
+#endif
+    last = (--my_wdt_clients == 0);
+    spin_unlock_irqrestore(&my_wdt_lock, flags);
+    kfree(client);
+
 #ifndef CONFIG_WATCHDOG_NOWAYOUT
-    /* Disable watchdog */
-    WD_CONTROL_REGISTER &= ~(1 << WENABLE_SHIFT);
+    if (last) {
+        /* Stop servicing the watchdog */
+        hrtimer_cancel(&my_wdt_timer);
+
+        /* Disable watchdog */
+        my_wdt_hw_disable();
+    }
 #endif
+    mutex_unlock(&my_wdt_mutex);
     return 0;
 }
 
@@ -55,39 +330,153 @@ static int my_wdt_close(struct inode *inode, struct file *file)
 static ssize_t my_wdt_write(struct file *file, const char *data,
         size_t len, loff_t *ppose)
 {
-    /* Pet the dog by writing a specified squence of bytes to the 
-     * watchdog service register */
-    WD_SERVICE_REGISTER = 0xABCD;
+    /* Refresh this client's deadline. my_wdt_sample() writes the
+     * service register while every client is healthy */
+    my_wdt_pet(file->private_data);
+    return len;
+}
+
+/* Wheel tick. Samples the heartbeat page, expires the clients whose
+ * deadline is this tick, and services the hardware only if no
+ * client has expired */
+static enum hrtimer_restart my_wdt_sample(struct hrtimer *timer)
+{
+    unsigned long beat = my_wdt_page->heartbeat;
+    unsigned int slot;
+
+    spin_lock(&my_wdt_lock);
+    if (beat != my_wdt_last_beat && my_wdt_page_owner)
+        my_wdt_pet_locked(my_wdt_page_owner);
+    my_wdt_last_beat = beat;
+
+    slot = ++my_wdt_now % WHEEL_SLOTS;
+    my_wdt_expired += my_wdt_wheel[slot];
+    my_wdt_wheel[slot] = 0;
+
+    if (!my_wdt_expired) my_wdt_hw_service();
+    spin_unlock(&my_wdt_lock);
+
+    hrtimer_forward_now(timer, ns_to_ktime((u64)sample_ms * NSEC_PER_MSEC));
+    return HRTIMER_RESTART;
 }
 
-/* Ioctl method. Look at Documentation/watchdog/watchdog-api.txt 
- * for the full list of ioctl command. This is standard across 
- * watchdog drivers, so conforming applications are renderd 
+/* Map the heartbeat page into the application. Bumping the counter
+ * then pets this client; write and WDIOC_KEEPALIVE keep working
+ * alongside. One client at a time may own the page */
+static int my_wdt_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long flags;
+    int ret = 0;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+
+    spin_lock_irqsave(&my_wdt_lock, flags);
+    if (my_wdt_page_owner && my_wdt_page_owner != file->private_data) {
+        ret = -EBUSY;
+    } else {
+        my_wdt_page_owner = file->private_data;
+        my_wdt_last_beat = my_wdt_page->heartbeat;
+    }
+    spin_unlock_irqrestore(&my_wdt_lock, flags);
+    if (ret) return ret;
+
+    if (remap_pfn_range(vma, vma->vm_start,
+                virt_to_phys(my_wdt_page) >> PAGE_SHIFT,
+                PAGE_SIZE, vma->vm_page_prot))
+        return -EAGAIN;
+
+    return 0;
+}
+
+/* Debugfs methods for the margin histograms. Reading prints one
+ * line per bucket, writing anything clears the histogram */
+static int my_wdt_hist_open(struct inode *inode, struct file *file)
+{
+    file->private_data = inode->i_private;
+    return 0;
+}
+
+static ssize_t my_wdt_hist_read(struct file *file, char __user *ubuf,
+        size_t count, loff_t *ppos)
+{
+    struct my_wdt_hist *hist = file->private_data;
+    char buf[MARGIN_BUCKETS * 32 + 32];
+    int i, len = 0;
+
+    for (i = 0; i < MARGIN_BUCKETS - 1; i++)
+        len += sprintf(buf + len, "< %6u ms %10u\n", 1 << i,
+                hist->bucket[i]);
+    len += sprintf(buf + len, ">= %5u ms %10u\n", 1 << (i - 1),
+            hist->bucket[i]);
+    len += sprintf(buf + len, "missed    %10u\n", hist->missed);
+
+    return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t my_wdt_hist_write(struct file *file, const char __user *ubuf,
+        size_t count, loff_t *ppos)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&my_wdt_lock, flags);
+    memset(file->private_data, 0, sizeof(struct my_wdt_hist));
+    spin_unlock_irqrestore(&my_wdt_lock, flags);
+    return count;
+}
+
+static struct file_operations my_wdt_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = my_wdt_hist_open,
+    .read = my_wdt_hist_read,
+    .write = my_wdt_hist_write,
+};
+
+/* Ioctl method. Look at Documentation/watchdog/watchdog-api.txt
+ * for the full list of ioctl command. This is standard across
+ * watchdog drivers, so conforming applications are renderd
  * hardware-independent */
 static int my_wdt_ioctl(struct inode*inode, struct file *file,
         unsigned int cmd, unsigned long arg)
 {
+    struct my_wdt_client *client = file->private_data;
+    unsigned long flags;
+    ktime_t left;
+    int timeout;
+
     /* ... */
     switch (cmd) {
         case WDIOC_KEEPALIVE:
-            /* Write to the watchdog. Applications can invoke
+            /* Pet the dog. Applications can invoke
              * this ioctl instead of writing to the device */
-            WD_SERVICE_REGISTER = 0XABCD;
+            my_wdt_pet(client);
             break;
         case WDIOC_SETTIMEOUT:
-            copy_from_user(&timeout, (int *)arg, sizeof(int));
+            if (copy_from_user(&timeout, (int *)arg, sizeof(int)))
+                return -EFAULT;
+            if (timeout <= 0) return -EINVAL;
 
-            /* Set the timeout that defines unresponsiveness by
-             * writing to the watchdog control register */
-            WD_CONTROL_REGISTER = timeout << TIMEOUT_BITS;
-            break;
+            /* Set the timeout that defines unresponsiveness of
+             * this client, and restart its countdown. The hardware
+             * timeout stays at DEFAULT_WATCHDOG_TIMEOUT */
+            client->timeout = min_t(unsigned int, timeout,
+                    (WHEEL_SLOTS - 1) * sample_ms / 1000);
+            my_wdt_pet(client);
+            /* Fall through */
         case WDIOC_GETTIMEOUT:
-            /* Get the current set timeout from the watchdog */
-            /* ... */
-            break;
+            /* Get the timeout of this client */
+            return put_user(client->timeout, (int *)arg);
+        case WDIOC_GETTIMELEFT:
+            /* Seconds left before this client expires */
+            spin_lock_irqsave(&my_wdt_lock, flags);
+            left = ktime_sub(client->expires, ktime_get());
+            spin_unlock_irqrestore(&my_wdt_lock, flags);
+            timeout = ktime_to_us(left) > 0 ? ktime_to_timeval(left).tv_sec : 0;
+            return put_user(timeout, (int *)arg);
         default:
             return -ENOTTY;
     }
+    return 0;
 }
 
 /* Module Exit */
@@ -95,6 +484,13 @@ static void __exit my_wdt_exit(void)
 {
     /* ... */
     misc_deregister(&my_wdt_dev);
+    hrtimer_cancel(&my_wdt_timer);
+#ifdef MY_WDT_EMULATE
+    hrtimer_cancel(&my_wdt_emu_timer);
+#endif
+    debugfs_remove_recursive(my_wdt_debugfs);
+    ClearPageReserved(virt_to_page(my_wdt_page));
+    free_page((unsigned long)my_wdt_page);
     /* ... */
 }
 
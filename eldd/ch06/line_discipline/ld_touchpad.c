@@ -1,35 +1,333 @@
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+
+#include "n_touch.h"
+
+#define CREATE_TRACE_POINTS
+#include "n_touch_trace.h"
+
+/* The touch controller. A packet is a header byte carrying the touch
+ * state in bit 0, then X and Y as 14-bit values in two 7-bit bytes
+ * each. n_touch_report(), the filter and the records all decode it
+ * with TOUCH_PKT_X(), TOUCH_PKT_Y() and TOUCH_PKT_TOUCH().
+ * Datasheet-dependent */
+#define PACKET_SIZE         5
+#define TOUCH_PKT_HEADER    0x80
+#define TOUCH_MAX_X         0x3FFF
+#define TOUCH_MAX_Y         0x3FFF
+
+#define TOUCH_PKT_X(pkt)        ((pkt)[1] << 7 | (pkt)[2])
+#define TOUCH_PKT_Y(pkt)        ((pkt)[3] << 7 | (pkt)[4])
+#define TOUCH_PKT_TOUCH(pkt)    ((pkt)[0] & 1)
+
+/* Packet format, one entry per byte of a packet: a byte belongs at
+ * that position if (byte & mask) == value. The header is fixed but
+ * for the touch state, so there are just two header bytes and the
+ * parser can find packet boundaries with memchr(). Payload bytes have
+ * the top bit clear and can't be mistaken for a header */
+#define TOUCH_HDR_RELEASE   (TOUCH_PKT_HEADER & 0xFE)
+#define TOUCH_HDR_TOUCH     (TOUCH_PKT_HEADER | 0x01)
+
+static const struct n_touch_field {
+    unsigned char mask;
+    unsigned char value;
+} n_touch_proto[PACKET_SIZE] = {
+    [0]                   = { 0xFE, TOUCH_HDR_RELEASE },
+    [1 ... PACKET_SIZE-1] = { 0x80, 0x00 },
+};
+
 /* Private struct used to impolement the Finite State Machine
  * (FSM) for the touch controller. The controller and the processor
- * communicate using a specific protocol that the FSM implements */
+ * communicate using a specific protocol that the FSM implements.
+ * There is one instance per tty that N_TCH is attached to,
+ * allocated from n_touch_cachep */
 struct n_touch {
     int current_state;  /* Finite State Machine */
-    spinlock_t touch_lock;  /* Spinlock */
     struct tty_struct *tty;  /* Associated tty */
+    unsigned char current_pkt[PACKET_SIZE]; /* Packet being parsed */
+    int pkt_len;  /* Bytes collected in current_pkt */
+    int mode;  /* TOUCH_MODE_*, changed under read_lock and mode_lock */
+    spinlock_t mode_lock;  /* Keeps a mode switch out of a parse */
+    ktime_t stamp;  /* Arrival time of the chunk being parsed */
+    struct input_dev *input;  /* Touch events in TOUCH_MODE_INPUT,
+                                 registered on first use */
+
+    /* Reader wakeup coalescing, see TOUCH_IOC_WAKEUP */
+    struct touch_wakeup wakeup;
+    atomic_t wake_pending;  /* Packets queued since the last wakeup */
+    struct hrtimer wake_timer;  /* Latency bound on a partial batch */
+
+    /* Flow control, see TOUCH_IOC_THROTTLE. n_touch_receive_buf()
+     * sets N_TOUCH_THROTTLED and n_touch_read() clears it */
+    struct touch_throttle throttle;
+    unsigned long flags;
+    unsigned int throttle_head; /* read_head at the last throttle */
+    unsigned int max_skid;  /* Most ring bytes queued after a throttle */
+
+    /* Filter stage, see TOUCH_IOC_FILTER. Only the parser uses the
+     * history and the last packet let through */
+    struct touch_filter filter;
+    int hist_x[TOUCH_FILTER_MAX];
+    int hist_y[TOUCH_FILTER_MAX];
+    unsigned int hist_len, hist_pos;
+    int last_x, last_y, last_touch;  /* last_touch < 0: none yet */
+
+    /* Read buffer. A single-producer/single-consumer ring: only
+     * n_touch_receive_buf() advances read_head, and read_tail moves
+     * only under tail_lock, so the producer never takes a lock. Both
+     * indices run freely and are masked with BUFFER_SIZE - 1, which
+     * must be a power of two */
+    struct mutex read_lock;  /* One reader at a time, as n_tty's
+                                atomic_read_lock. Held while asleep */
+    struct mutex tail_lock;  /* Moves read_tail. Never held while
+                                asleep, so a flush can always take it */
+    unsigned char *read_buf;
+    unsigned int read_head;
+    unsigned int read_tail ____cacheline_aligned_in_smp; /* Reader's line */
+
     /* Stataistics and other housekeeping */
+    struct touch_stats stats;
     /* ... */
-} *n_tch;
+};
+
+#define N_TOUCH_THROTTLED   0   /* Bit in n_touch.flags */
+
+/* Slab cache for the per-tty state. Cache line alignment keeps the
+ * instances of different ports from sharing lines */
+static struct kmem_cache *n_touch_cachep;
+
+/* Counters across all N_TCH ttys, summed over CPUs when read from
+ * /sys/kernel/debug/n_touch/counters. Each CPU bumps its own copy
+ * without locks or shared cache lines, cheap enough to leave on */
+struct n_touch_counters {
+    unsigned long bytes_in;     /* Bytes received from the driver */
+    unsigned long packets_out;  /* Packets queued or reported */
+    unsigned long parse_errors; /* Bytes that broke a packet */
+    unsigned long overruns;     /* Packets lost to a full ring */
+};
+
+static DEFINE_PER_CPU(struct n_touch_counters, n_touch_counters);
+static struct dentry *n_touch_debugfs;
+
+/* Number of bytes waiting in the read ring */
+static unsigned int n_touch_ring_count(struct n_touch *ntch)
+{
+    return ACCESS_ONCE(ntch->read_head) - ACCESS_ONCE(ntch->read_tail);
+}
+
+/* Producer side of the read ring. Copies one packet or record in
+ * with at most two memcpy()s, split at the end of the buffer. Returns
+ * 0 if the ring has no room for it */
+static int n_touch_ring_put(struct n_touch *ntch, const void *data,
+        unsigned int len)
+{
+    const unsigned char *pkt = data;
+    unsigned int head = ntch->read_head;
+    unsigned int off, first;
+
+    if (BUFFER_SIZE - (head - ACCESS_ONCE(ntch->read_tail)) < len)
+        return 0;
+
+    /* Don't overwrite bytes before the reader is done with them */
+    smp_mb();
+
+    off = head & (BUFFER_SIZE - 1);
+    first = min(len, BUFFER_SIZE - off);
+    memcpy(ntch->read_buf + off, pkt, first);
+    memcpy(ntch->read_buf, pkt + first, len - first);
+
+    /* Publish the packet before the new head */
+    smp_wmb();
+    ntch->read_head = head + len;
+    return 1;
+}
+
+/* Consumer side of the read ring. Copies up to nr bytes to user
+ * space, split in at most two parts. Returns the number of bytes
+ * copied or -EFAULT. Called with tail_lock held */
+static ssize_t n_touch_ring_get(struct n_touch *ntch,
+        unsigned char __user *buf, size_t nr)
+{
+    unsigned int tail = ntch->read_tail;
+    unsigned int off, first, n;
+
+    n = min_t(size_t, nr, ACCESS_ONCE(ntch->read_head) - tail);
+    if (!n) return 0;
+
+    /* Read the packet only after seeing the head that published it */
+    smp_rmb();
+
+    off = tail & (BUFFER_SIZE - 1);
+    first = min(n, BUFFER_SIZE - off);
+    if (copy_to_user(buf, ntch->read_buf + off, first) ||
+            copy_to_user(buf + first, ntch->read_buf, n - first))
+        return -EFAULT;
+
+    /* Finish reading before handing the space back */
+    smp_mb();
+    ntch->read_tail = tail + n;
+    return n;
+}
+
+/* Unthrottle the serial driver once the reader has drained the ring
+ * down to the low watermark */
+static void n_touch_unthrottle(struct n_touch *ntch)
+{
+    struct tty_struct *tty = ntch->tty;
+
+    if (n_touch_ring_count(ntch) > ntch->throttle.low) return;
+    if (!test_and_clear_bit(N_TOUCH_THROTTLED, &ntch->flags)) return;
+    ntch->stats.unthrottles++;
+    trace_n_touch_throttle(tty, n_touch_ring_count(ntch), 0);
+    if (tty->driver->unthrottle) tty->driver->unthrottle(tty);
+}
+
+/* Throttle the serial driver if the ring has filled up to the high
+ * watermark. Called from n_touch_receive_buf() once a chunk is
+ * parsed */
+static void n_touch_throttle(struct n_touch *ntch)
+{
+    struct tty_struct *tty = ntch->tty;
+    unsigned int high, skid;
+
+    if (test_bit(N_TOUCH_THROTTLED, &ntch->flags)) {
+        /* Data still in flight after the throttle, measured in ring
+         * bytes like the watermarks: a record takes more room than
+         * the bytes it was parsed from. Keep room for twice the worst
+         * case seen, but stay above low */
+        skid = ntch->read_head - ntch->throttle_head;
+        if (ntch->throttle.adaptive && skid > ntch->max_skid) {
+            ntch->max_skid = skid;
+            high = BUFFER_SIZE - min(2 * ntch->max_skid, BUFFER_SIZE);
+            ntch->throttle.high = max(high,
+                    ntch->throttle.low + PACKET_SIZE);
+        }
+        return;
+    }
+
+    if (n_touch_ring_count(ntch) < ntch->throttle.high) return;
+    ntch->throttle_head = ntch->read_head;
+    ntch->stats.throttles++;
+    trace_n_touch_throttle(tty, n_touch_ring_count(ntch), 1);
+
+    /* Throttle before setting the bit, so an unthrottle can't get in
+     * ahead of the throttle it undoes */
+    if (tty->driver->throttle) tty->driver->throttle(tty);
+    set_bit(N_TOUCH_THROTTLED, &ntch->flags);
+
+    /* A reader that drained the ring before the bit was set saw
+     * nothing to unthrottle. Do it for it */
+    smp_mb__after_set_bit();
+    n_touch_unthrottle(ntch);
+}
+
+/* Register the input device that TOUCH_MODE_INPUT reports to */
+static int n_touch_input_register(struct n_touch *ntch)
+{
+    struct input_dev *input;
+    int err;
+
+    /* Allocate an input device data structure */
+    input = input_allocate_device();
+    if (!input) return -ENOMEM;
+    input->name = "n_touch";
+
+    /* Announce that the controller generates absolute coordinates
+     * and touch/release */
+    set_bit(EV_ABS, input->evbit);
+    set_bit(EV_KEY, input->evbit);
+    set_bit(BTN_TOUCH, input->keybit);
+    input_set_abs_params(input, ABS_X, 0, TOUCH_MAX_X, 0, 0);
+    input_set_abs_params(input, ABS_Y, 0, TOUCH_MAX_Y, 0, 0);
+
+    /* Register with the input subsystem */
+    if ((err = input_register_device(input))) {
+        input_free_device(input);
+        return err;
+    }
+    ntch->input = input;
+    return 0;
+}
+
+/* Wake up readers waiting for data */
+static void n_touch_wake_readers(struct n_touch *ntch)
+{
+    struct tty_struct *tty = ntch->tty;
+
+    atomic_set(&ntch->wake_pending, 0);
+    if (waitqueue_active(&tty->read_wait) &&
+            (n_touch_ring_count(ntch) >= tty->minimum_to_wait)) {
+        trace_n_touch_wakeup(tty, n_touch_ring_count(ntch));
+        wake_up_interruptible(&tty->read_wait);
+    }
+}
+
+/* The latency budget of a partial batch ran out */
+static enum hrtimer_restart n_touch_wake_timeout(struct hrtimer *timer)
+{
+    n_touch_wake_readers(container_of(timer, struct n_touch, wake_timer));
+    return HRTIMER_NORESTART;
+}
+
+/* Account for added packets in the read ring and wake up readers
+ * according to the wakeup policy */
+static void n_touch_wake(struct n_touch *ntch, int added)
+{
+    int pending = atomic_add_return(added, &ntch->wake_pending);
+
+    if (!ntch->wakeup.usecs || pending >= ntch->wakeup.packets) {
+        /* Batch complete */
+        hrtimer_try_to_cancel(&ntch->wake_timer);
+        n_touch_wake_readers(ntch);
+    } else if (pending == added) {
+        /* First packet of a batch, start the latency budget */
+        hrtimer_start(&ntch->wake_timer,
+                ns_to_ktime((u64)ntch->wakeup.usecs * NSEC_PER_USEC),
+                HRTIMER_MODE_REL);
+    }
+}
 
 /* Device open() */
 static int n_touch_open(struct tty_struct *tty)
 {
-    /* Allocate memory for n_tch */
-    if (!(n_tch = kmalloc(sizeof(struct n_touch), GFP_KERNEL))) {
+    struct n_touch *ntch;
+
+    /* Allocate this tty's instance */
+    if (!(ntch = kmem_cache_zalloc(n_touch_cachep, GFP_KERNEL))) {
         return -ENOMEM;
     }
-    memset(n_tch, 0, sizeof(struct n_touch));
 
-    tty->disc_data = n_tch; /* Other entry points now have direct
-                               access to n_tch */
     /* Allocate the line discipline's local read buffer
      * used for copying data out of the tty flip buffer */
-    tty->read_buf = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!tty->read_buf) return -ENOMEM;
+    ntch->read_buf = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+    if (!ntch->read_buf) {
+        kmem_cache_free(n_touch_cachep, ntch);
+        return -ENOMEM;
+    }
 
     /* Clear the read buffer */
-    memset(tty->read_buf, 0, BUFFER_SIZE);
+    memset(ntch->read_buf, 0, BUFFER_SIZE);
+    mutex_init(&ntch->read_lock);
+    mutex_init(&ntch->tail_lock);
+    spin_lock_init(&ntch->mode_lock);
+    ntch->tty = tty;
+
+    /* Wake readers on every packet until told otherwise */
+    ntch->wakeup.packets = 1;
+    ntch->wakeup.usecs = 0;
+    hrtimer_init(&ntch->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ntch->wake_timer.function = n_touch_wake_timeout;
 
-    /* Initialize lock */
-    spin_lock_init(&n_tch->touch_lock);
+    /* Throttle as the book's driver did, unthrottle at a quarter */
+    ntch->throttle.high = BUFFER_SIZE - TOUCH_THROTTLE_THRESHOLD;
+    ntch->throttle.low = BUFFER_SIZE / 4;
+
+    /* Filter stage off */
+    ntch->filter.window = 1;
+    ntch->last_touch = -1;
+
+    tty->disc_data = ntch; /* Other entry points now have direct
+                              access to ntch */
 
     /* Initialize other necessary tty fields.
      * See drivers/char/n_tty.c for an example */
@@ -38,10 +336,375 @@ static int n_touch_open(struct tty_struct *tty)
     return 0;
 }
 
+/* Device close() */
+static void n_touch_close(struct tty_struct *tty)
+{
+    struct n_touch *ntch = tty->disc_data;
+
+    tty->disc_data = NULL;
+    hrtimer_cancel(&ntch->wake_timer);
+    if (ntch->input) input_unregister_device(ntch->input);
+    kfree(ntch->read_buf);
+    kmem_cache_free(n_touch_cachep, ntch);
+}
+
+/* Number of processed characters waiting to be read */
+static ssize_t n_touch_chars_in_buffer(struct tty_struct *tty)
+{
+    return n_touch_ring_count(tty->disc_data);
+}
+
+/* Room left in the read buffer */
+static int n_touch_receive_room(struct tty_struct *tty)
+{
+    return BUFFER_SIZE - n_touch_ring_count(tty->disc_data);
+}
+
+/* Called when data is requested from user space */
+static ssize_t n_touch_read(struct tty_struct *tty, struct file *file,
+        unsigned char __user *buf, size_t nr)
+{
+    struct n_touch *ntch = tty->disc_data;
+    DECLARE_WAITQUEUE(wait, current);
+    ssize_t ret;
+
+    /* Readers of the same tty take turns */
+    if (file->f_flags & O_NONBLOCK) {
+        if (!mutex_trylock(&ntch->read_lock)) return -EAGAIN;
+    } else if (mutex_lock_interruptible(&ntch->read_lock)) {
+        return -ERESTARTSYS;
+    }
+
+    /* Records are handed out whole. The mode can't change under
+     * read_lock */
+    if (ntch->mode == TOUCH_MODE_RECORD) {
+        nr -= nr % sizeof(struct touch_record);
+        if (!nr) {
+            mutex_unlock(&ntch->read_lock);
+            return -EINVAL;
+        }
+    }
+
+    add_wait_queue(&tty->read_wait, &wait);
+    while (1) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (n_touch_ring_count(ntch)) {
+            /* copy_to_user() may fault and sleep */
+            __set_current_state(TASK_RUNNING);
+            mutex_lock(&ntch->tail_lock);
+            ret = n_touch_ring_get(ntch, buf, nr);
+            mutex_unlock(&ntch->tail_lock);
+            if (ret) {
+                if (ret > 0) n_touch_unthrottle(ntch);
+                break;
+            }
+            continue;   /* Flushed in the meantime */
+        }
+        if (test_bit(TTY_OTHER_CLOSED, &tty->flags)) {
+            ret = -EIO;
+            break;
+        }
+        if (tty_hung_up_p(file)) {
+            ret = 0;
+            break;
+        }
+        if (file->f_flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            break;
+        }
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        /* Never sleep on an empty ring with the driver throttled */
+        n_touch_unthrottle(ntch);
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    remove_wait_queue(&tty->read_wait, &wait);
+    mutex_unlock(&ntch->read_lock);
+
+    trace_n_touch_read(tty, ret);
+    return ret;
+}
+
+/* Discard unread data. Called on TCFLSH and on hangup, possibly with
+ * a reader asleep under read_lock, so only tail_lock is taken */
+static void n_touch_flush_buffer(struct tty_struct *tty)
+{
+    struct n_touch *ntch = tty->disc_data;
+
+    mutex_lock(&ntch->tail_lock);
+    ntch->read_tail = ACCESS_ONCE(ntch->read_head);
+    mutex_unlock(&ntch->tail_lock);
+    n_touch_unthrottle(ntch);
+}
+
+/* Readable while the ring holds data */
+static unsigned int n_touch_poll(struct tty_struct *tty, struct file *file,
+        poll_table *wait)
+{
+    poll_wait(file, &tty->read_wait, wait);
+    return n_touch_ring_count(tty->disc_data) ? POLLIN | POLLRDNORM : 0;
+}
+
+/* Decode a packet and report it through the input device, one
+ * input_sync() per packet */
+static void n_touch_report(struct n_touch *ntch, const unsigned char *pkt)
+{
+    input_report_abs(ntch->input, ABS_X, TOUCH_PKT_X(pkt));
+    input_report_abs(ntch->input, ABS_Y, TOUCH_PKT_Y(pkt));
+    input_report_key(ntch->input, BTN_TOUCH, TOUCH_PKT_TOUCH(pkt));
+    input_sync(ntch->input);
+}
+
+/* Median of the first n values of hist. n is at most
+ * TOUCH_FILTER_MAX, so an insertion sort of a copy is plenty */
+static int n_touch_median(const int *hist, unsigned int n)
+{
+    int v[TOUCH_FILTER_MAX], x;
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        x = hist[i];
+        for (j = i; j && v[j - 1] > x; j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+    return v[n / 2];
+}
+
+/* Filter stage. Returns the packet to pass on, which is pkt itself or
+ * a smoothed copy in buf, or NULL if the packet carries nothing new */
+static const unsigned char *n_touch_filter(struct n_touch *ntch,
+        const unsigned char *pkt, unsigned char *buf)
+{
+    struct touch_filter *f = &ntch->filter;
+    int x = TOUCH_PKT_X(pkt);
+    int y = TOUCH_PKT_Y(pkt);
+    int touch = TOUCH_PKT_TOUCH(pkt);
+
+    if (f->window > 1) {
+        if (touch) {
+            ntch->hist_x[ntch->hist_pos] = x;
+            ntch->hist_y[ntch->hist_pos] = y;
+            ntch->hist_pos = (ntch->hist_pos + 1) % f->window;
+            ntch->hist_len = min(ntch->hist_len + 1, f->window);
+            x = n_touch_median(ntch->hist_x, ntch->hist_len);
+            y = n_touch_median(ntch->hist_y, ntch->hist_len);
+        } else {
+            /* Don't smooth the next touch with this one */
+            ntch->hist_len = ntch->hist_pos = 0;
+        }
+    }
+
+    if (f->dedup && touch == ntch->last_touch &&
+            abs(x - ntch->last_x) <= f->distance &&
+            abs(y - ntch->last_y) <= f->distance) {
+        ntch->stats.filtered++;
+        return NULL;
+    }
+    ntch->last_x = x;
+    ntch->last_y = y;
+    ntch->last_touch = touch;
+
+    if (f->window <= 1) return pkt;
+    memcpy(buf, pkt, PACKET_SIZE);
+    buf[1] = x >> 7;
+    buf[2] = x & 0x7F;
+    buf[3] = y >> 7;
+    buf[4] = y & 0x7F;
+    return buf;
+}
+
+/* Hand a complete packet to the reader, or to the input subsystem.
+ * Returns the number of packets added to the read ring */
+static int n_touch_emit(struct n_touch *ntch, const unsigned char *pkt)
+{
+    unsigned char buf[PACKET_SIZE];
+
+    ntch->stats.packets++;
+    trace_n_touch_packet(ntch->tty, pkt);
+    if (!(pkt = n_touch_filter(ntch, pkt, buf))) return 0;
+    if (ntch->mode == TOUCH_MODE_INPUT) {
+        n_touch_report(ntch, pkt);
+        this_cpu_inc(n_touch_counters.packets_out);
+        return 0;
+    }
+    if (ntch->mode == TOUCH_MODE_RECORD) {
+        struct touch_record rec;
+
+        rec.timestamp = ktime_to_ns(ntch->stamp);
+        rec.x = TOUCH_PKT_X(pkt);
+        rec.y = TOUCH_PKT_Y(pkt);
+        rec.touch = TOUCH_PKT_TOUCH(pkt);
+        rec.reserved = 0;
+        if (n_touch_ring_put(ntch, &rec, sizeof(rec))) goto queued;
+    } else if (n_touch_ring_put(ntch, pkt, PACKET_SIZE)) {
+        goto queued;
+    }
+
+    /* Full, drop the packet */
+    ntch->stats.overruns++;
+    this_cpu_inc(n_touch_counters.overruns);
+    return 0;
+
+queued:
+    this_cpu_inc(n_touch_counters.packets_out);
+    return 1;
+}
+
+
+/* Walk a whole flip buffer chunk in one pass and put every complete
+ * packet into the read ring. A packet may start in one chunk and end
+ * in the next; current_pkt holds it in between. After a bad byte the
+ * parser resyncs by scanning for the next header with memchr().
+ * Returns the number of packets put into the ring */
+static int n_touch_parse(struct n_touch *ntch, const unsigned char *cp,
+        const char *fp, int count)
+{
+    const unsigned char *end = cp + count, *hdr, *next;
+    const struct n_touch_field *field;
+    int i, n, done = 0;
+
+    while (cp < end) {
+        if (!ntch->pkt_len) {
+            /* Between packets. Skip to the next header, whichever
+             * of the two comes first */
+            hdr = memchr(cp, TOUCH_HDR_TOUCH, end - cp);
+            next = memchr(cp, TOUCH_HDR_RELEASE, (hdr ? hdr : end) - cp);
+            if (next) hdr = next;
+            if (!hdr) break;
+            if (fp) fp += hdr - cp;
+            cp = hdr;
+        }
+
+        /* Check the rest of the packet, or as much as this chunk has */
+        n = min_t(int, PACKET_SIZE - ntch->pkt_len, end - cp);
+        field = &n_touch_proto[ntch->pkt_len];
+        for (i = 0; i < n; i++) {
+            if ((cp[i] & field[i].mask) != field[i].value) break;
+            if (fp && fp[i] != TTY_NORMAL) break;
+        }
+
+        if (i < n) {
+            /* Bad byte. Drop the partial packet and resync, at the
+             * bad byte itself unless it is where the packet began */
+            ntch->stats.parse_errors++;
+            this_cpu_inc(n_touch_counters.parse_errors);
+            if (!ntch->pkt_len && !i) i = 1;
+            ntch->pkt_len = 0;
+            cp += i;
+            if (fp) fp += i;
+            continue;
+        }
+
+        if (!ntch->pkt_len && n == PACKET_SIZE) {
+            /* Whole packet inside the chunk, no need to collect it */
+            done += n_touch_emit(ntch, cp);
+        } else {
+            memcpy(ntch->current_pkt + ntch->pkt_len, cp, n);
+            ntch->pkt_len += n;
+            if (ntch->pkt_len == PACKET_SIZE) {
+                done += n_touch_emit(ntch, ntch->current_pkt);
+                ntch->pkt_len = 0;
+            }
+        }
+        cp += n;
+        if (fp) fp += n;
+    }
+
+    return done;
+}
+
+/* I/O control commands */
+static int n_touch_ioctl(struct tty_struct *tty, struct file *file,
+        unsigned int cmd, unsigned long arg)
+{
+    struct n_touch *ntch = tty->disc_data;
+    struct touch_wakeup wakeup;
+    struct touch_throttle throttle;
+    struct touch_filter filter;
+    unsigned long flags;
+    int mode, err;
+
+    switch (cmd) {
+        case TOUCH_IOC_MODE:
+            if (get_user(mode, (int __user *)arg)) return -EFAULT;
+            if (mode != TOUCH_MODE_RAW && mode != TOUCH_MODE_INPUT &&
+                    mode != TOUCH_MODE_RECORD)
+                return -EINVAL;
+            if (mutex_lock_interruptible(&ntch->read_lock))
+                return -ERESTARTSYS;
+            /* The input device exists only once it is asked for, so
+             * raw and record ports don't show up as touchscreens */
+            if (mode == TOUCH_MODE_INPUT && !ntch->input &&
+                    (err = n_touch_input_register(ntch))) {
+                mutex_unlock(&ntch->read_lock);
+                return err;
+            }
+            if (mode != ntch->mode) {
+                /* With the reader and the parser both held off, drop
+                 * unread data and any partial packet in the old
+                 * format, so the ring never mixes the two */
+                mutex_lock(&ntch->tail_lock);
+                spin_lock_irqsave(&ntch->mode_lock, flags);
+                ntch->mode = mode;
+                ntch->pkt_len = 0;
+                ntch->read_tail = ntch->read_head;
+                spin_unlock_irqrestore(&ntch->mode_lock, flags);
+                mutex_unlock(&ntch->tail_lock);
+                n_touch_unthrottle(ntch);
+            }
+            mutex_unlock(&ntch->read_lock);
+            return 0;
+        case TOUCH_IOC_WAKEUP:
+            if (copy_from_user(&wakeup, (void __user *)arg, sizeof(wakeup)))
+                return -EFAULT;
+            if (!wakeup.packets) return -EINVAL;
+            hrtimer_cancel(&ntch->wake_timer);
+            ntch->wakeup = wakeup;
+            /* Don't strand packets queued under the old policy */
+            n_touch_wake_readers(ntch);
+            return 0;
+        case TOUCH_IOC_THROTTLE:
+            if (copy_from_user(&throttle, (void __user *)arg,
+                        sizeof(throttle)))
+                return -EFAULT;
+            if (throttle.high > BUFFER_SIZE || throttle.high < PACKET_SIZE ||
+                    throttle.low > throttle.high - PACKET_SIZE)
+                return -EINVAL;
+            ntch->throttle = throttle;
+            ntch->max_skid = 0;
+            n_touch_unthrottle(ntch);
+            return 0;
+        case TOUCH_IOC_FILTER:
+            if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+                return -EFAULT;
+            if (!filter.window || filter.window > TOUCH_FILTER_MAX)
+                return -EINVAL;
+            /* Start the new window and duplicate check afresh */
+            ntch->filter = filter;
+            ntch->hist_len = ntch->hist_pos = 0;
+            ntch->last_touch = -1;
+            return 0;
+        case TOUCH_IOC_STATS:
+            if (copy_to_user((void __user *)arg, &ntch->stats,
+                        sizeof(ntch->stats)))
+                return -EFAULT;
+            return 0;
+        default:
+            /* Let the tty core handle the rest */
+            return -ENOIOCTLCMD;
+    }
+}
 
 static void n_touch_receive_buf(struct tty_struct *tty, const unsigned char *cp,
         char *fp, int count)
 {
+    struct n_touch *ntch = tty->disc_data;
+    unsigned long flags;
+    int added;
+
     /* Work on the data in the line discipline's half of
      * the flip buffer pointed to by cp */
     /* ... */
@@ -50,52 +713,66 @@ static void n_touch_receive_buf(struct tty_struct *tty, const unsigned char *cp,
      * arriving from the touch controller and put the processed data
      * into the local read buffer */
 
+    this_cpu_add(n_touch_counters.bytes_in, count);
+
     /* Datasheet-dependent Code Region */
-    switch (tty->disc_data->current_state) {
-        case RESET:
-            /* Issue a reset command to the controller */
-            tty->driver->write(tty, 0, mode_stream_command,
-                    sizeof(mode_stream_command));
-            tty->disc_data->current_state = STREAM_DATA;
-            /* ... */
-            break;
-        case STREAM_DATA:
-            /* ... */
-            break;
-        case PARSING:
-            /* ... */
-            tty->disc_data->current_state = PARSED;
-            break;
-        case PARSED:
-            /* ... */
-    }
-
-    if (tty->disc_data->current_state == PARSED) {
-        /* If you have a parsed packet, copy the collected coordinate
-         * and direction information into the local read buffer */
-        spin_lock_irqsave(&tty->disc_data->touch_lock, flag);
-        for (i=0; i<PACKET_SIZE; i++) {
-            tty->disc_data->read_buf[tty->disc_data->read_head] =
-                tty->disc_data->current_pkt[i];
-            tty->disc_data->read_head =
-                (tty->disc_data->read_head + 1) & (BUFFER_SIZE - 1);
-            tty->disc_data->read_cnt++;
-        }
-        spin_lock_irqrestore(&tty->disc_data->touch_lock, flags);
-        /* ... */ 
-        /* Wake up any threads waiting for data */
-        if (waitqueue_active(&tty->read_wait) && 
-                (tty->read_cnt >= tty->minimum_to_wait)) {
-            wake_up_interruptible(&tty->read_wait);
-        }
-        /* If we are running out of buffer space, request the
-         * serial driver to throttle incoming data */
-        if (n_touch_receive_room(tty) < TOUCH_THROTTLE_THRESHOLD) {
-            tty->driver.throttle(tty);
-        }
+    if (ntch->current_state == RESET) {
+        /* Issue a reset command to the controller */
+        tty->driver->write(tty, 0, mode_stream_command,
+                sizeof(mode_stream_command));
+        trace_n_touch_state(tty, RESET, STREAM_DATA);
+        ntch->current_state = STREAM_DATA;
+        /* ... */
+    }
+
+    /* Parse the whole chunk in one mode. mode_lock is only ever
+     * contended by TOUCH_IOC_MODE; the ring itself needs no lock
+     * against n_touch_read() */
+    spin_lock_irqsave(&ntch->mode_lock, flags);
+    /* All packets completed in this chunk arrived now */
+    if (ntch->mode == TOUCH_MODE_RECORD) ntch->stamp = ktime_get();
+    added = n_touch_parse(ntch, cp, fp, count);
+    spin_unlock_irqrestore(&ntch->mode_lock, flags);
+
+    if (added) {
+        /* ... */
+        /* Wake up any threads waiting for data, in batches */
+        n_touch_wake(ntch, added);
         /* ... */
     }
-} 
+
+    /* If we are running out of buffer space, request the
+     * serial driver to throttle incoming data */
+    n_touch_throttle(ntch);
+}
+
+/* Debugfs read method for the per-CPU counters */
+static ssize_t n_touch_counters_read(struct file *file, char __user *ubuf,
+        size_t count, loff_t *ppos)
+{
+    struct n_touch_counters sum, *c;
+    char buf[128];
+    int cpu, len;
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+        c = &per_cpu(n_touch_counters, cpu);
+        sum.bytes_in += c->bytes_in;
+        sum.packets_out += c->packets_out;
+        sum.parse_errors += c->parse_errors;
+        sum.overruns += c->overruns;
+    }
+    len = sprintf(buf, "bytes_in     %lu\npackets_out  %lu\n"
+            "parse_errors %lu\noverruns     %lu\n", sum.bytes_in,
+            sum.packets_out, sum.parse_errors, sum.overruns);
+
+    return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static struct file_operations n_touch_counters_fops = {
+    .owner = THIS_MODULE,
+    .read = n_touch_counters_read,
+};
 
 struct tty_ldisc n_touch_ldisc = {
     TTY_LDISC_MAGIC,        /* Magic */
@@ -103,7 +780,7 @@ struct tty_ldisc n_touch_ldisc = {
     N_TCH,        /* Line discipline ID number */
     n_touch_open,        /* Open the line discipline */
     n_touch_close,        /* Close the line discipline */
-    n_touch_flush_buffer, /* Flush the line discipline's 
+    n_touch_flush_buffer, /* Flush the line discipline's
                              read buffer */
     n_touch_chars_in_buffer, /* Get the number of processed characters
                                 in the line discipline's read buffer */
@@ -123,6 +800,26 @@ struct tty_ldisc n_touch_ldisc = {
 
 /* ... */
 
+/* Slab cache for the per-tty state */
+n_touch_cachep = kmem_cache_create("n_touch", sizeof(struct n_touch), 0,
+        SLAB_HWCACHE_ALIGN, NULL);
+if (!n_touch_cachep) {
+    return -ENOMEM;
+}
+
 if ((err = tty_register_ldisc(N_TCH, &n_touch_ldisc))) {
+    kmem_cache_destroy(n_touch_cachep);
     return err;
 }
+
+/* /sys/kernel/debug/n_touch/ */
+n_touch_debugfs = debugfs_create_dir("n_touch", NULL);
+debugfs_create_file("counters", 0444, n_touch_debugfs, NULL,
+        &n_touch_counters_fops);
+
+/* ... */
+
+/* On module exit */
+debugfs_remove_recursive(n_touch_debugfs);
+tty_unregister_ldisc(N_TCH);
+kmem_cache_destroy(n_touch_cachep);
@@ -0,0 +1,95 @@
+/* Interface of the N_TCH line discipline, shared by ld_touchpad.c and
+ * the user space tools: the n_touch_ioctl() commands, the records
+ * n_touch_read() returns, and the capture file format written by
+ * userspace.c and read by touch_replay.c */
+#ifndef _N_TOUCH_H
+#define _N_TOUCH_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* n_touch_ioctl() commands. TOUCH_IOC_MODE selects where parsed
+ * packets go: to n_touch_read() as raw bytes or as timestamped
+ * records, or straight to the input subsystem, which spares a user
+ * space daemon the read and the uinput re-injection. Set the mode
+ * before data starts flowing; switching discards unread data */
+#define TOUCH_IOC_MODE      _IOW('t', 1, int)
+#define TOUCH_MODE_RAW      0   /* Bytes through n_touch_read() */
+#define TOUCH_MODE_INPUT    1   /* Events through the input device */
+#define TOUCH_MODE_RECORD   2   /* struct touch_record through n_touch_read() */
+
+/* Record returned by n_touch_read() in TOUCH_MODE_RECORD, a packet
+ * as decoded for the input device. A read returns as many whole
+ * records as fit in the user buffer */
+struct touch_record {
+    __u64 timestamp;        /* CLOCK_MONOTONIC ns of arrival */
+    __u16 x;                /* ABS_X */
+    __u16 y;                /* ABS_Y */
+    __u16 touch;            /* BTN_TOUCH */
+    __u16 reserved;
+};
+
+/* TOUCH_IOC_WAKEUP sets the reader wakeup policy: wake sleeping
+ * readers once packets packets are queued, or usecs microseconds
+ * after the first queued packet, whichever comes first. usecs == 0
+ * wakes on every packet */
+#define TOUCH_IOC_WAKEUP    _IOW('t', 2, struct touch_wakeup)
+
+struct touch_wakeup {
+    unsigned int packets;
+    unsigned int usecs;
+};
+
+/* TOUCH_IOC_THROTTLE sets the flow control watermarks, in bytes
+ * queued in the read ring: the serial driver is throttled once high
+ * bytes are queued and unthrottled once the reader has drained the
+ * ring down to low. With adaptive set, high is lowered to leave room
+ * for twice the most data seen arriving after a throttle */
+#define TOUCH_IOC_THROTTLE  _IOW('t', 3, struct touch_throttle)
+
+struct touch_throttle {
+    unsigned int high;
+    unsigned int low;
+    unsigned int adaptive;
+};
+
+/* TOUCH_IOC_STATS reads the per-instance counters */
+#define TOUCH_IOC_STATS     _IOR('t', 4, struct touch_stats)
+
+struct touch_stats {
+    __u64 packets;          /* Packets parsed */
+    __u64 parse_errors;     /* Bytes that broke a packet */
+    __u64 overruns;         /* Packets lost to a full ring */
+    __u64 throttles;        /* Serial driver throttled */
+    __u64 unthrottles;      /* Serial driver unthrottled */
+    __u64 filtered;         /* Packets dropped by the filter */
+};
+
+/* TOUCH_IOC_FILTER configures the filter stage that parsed packets
+ * pass before they are queued or reported. Coordinates are replaced
+ * by the median of the last window samples of the current touch.
+ * With dedup set, a packet is dropped if the touch state is unchanged
+ * and neither coordinate moved more than distance from the last
+ * packet let through; distance 0 drops exact repeats only. The
+ * default, dedup 0 and window 1, passes every packet unchanged */
+#define TOUCH_IOC_FILTER    _IOW('t', 5, struct touch_filter)
+#define TOUCH_FILTER_MAX    7   /* Largest median window */
+
+struct touch_filter {
+    unsigned int dedup;
+    unsigned int window;
+    unsigned int distance;
+};
+
+/* Capture file: CAP_MAGIC, then CAP_VERSION as a 32-bit word, then a
+ * struct cap_record ahead of each chunk of data read from a port */
+#define CAP_MAGIC           "TCAP"
+#define CAP_VERSION         1
+
+struct cap_record {
+    __u64 timestamp;        /* CLOCK_MONOTONIC ns of the chunk */
+    __u32 port;             /* Index of the tty it came from */
+    __u32 len;              /* Bytes of data that follow */
+};
+
+#endif /* _N_TOUCH_H */
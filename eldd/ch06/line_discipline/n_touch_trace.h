@@ -0,0 +1,105 @@
+/* Tracepoints of the N_TCH line discipline, under
+ * /sys/kernel/debug/tracing/events/n_touch/. Build ld_touchpad.c with
+ * -I$(src) so that define_trace.h finds this file */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM n_touch
+
+#if !defined(_N_TOUCH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _N_TOUCH_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/tty.h>
+
+/* The FSM moved from one state to another */
+TRACE_EVENT(n_touch_state,
+    TP_PROTO(struct tty_struct *tty, int old, int new),
+    TP_ARGS(tty, old, new),
+    TP_STRUCT__entry(
+        __string(name, tty->name)
+        __field(int, old)
+        __field(int, new)
+    ),
+    TP_fast_assign(
+        __assign_str(name, tty->name);
+        __entry->old = old;
+        __entry->new = new;
+    ),
+    TP_printk("%s state %d -> %d", __get_str(name), __entry->old,
+        __entry->new)
+);
+
+/* The parser completed a packet. Logs the header and coordinates */
+TRACE_EVENT(n_touch_packet,
+    TP_PROTO(struct tty_struct *tty, const unsigned char *pkt),
+    TP_ARGS(tty, pkt),
+    TP_STRUCT__entry(
+        __string(name, tty->name)
+        __field(unsigned char, header)
+        __field(int, x)
+        __field(int, y)
+    ),
+    TP_fast_assign(
+        __assign_str(name, tty->name);
+        __entry->header = pkt[0];
+        __entry->x = (pkt[1] << 7) | pkt[2];
+        __entry->y = (pkt[3] << 7) | pkt[4];
+    ),
+    TP_printk("%s header 0x%02x x %d y %d", __get_str(name),
+        __entry->header, __entry->x, __entry->y)
+);
+
+/* The serial driver was throttled (on != 0) or unthrottled, with
+ * queued bytes waiting in the read ring */
+TRACE_EVENT(n_touch_throttle,
+    TP_PROTO(struct tty_struct *tty, unsigned int queued, int on),
+    TP_ARGS(tty, queued, on),
+    TP_STRUCT__entry(
+        __string(name, tty->name)
+        __field(unsigned int, queued)
+        __field(int, on)
+    ),
+    TP_fast_assign(
+        __assign_str(name, tty->name);
+        __entry->queued = queued;
+        __entry->on = on;
+    ),
+    TP_printk("%s %s queued %u", __get_str(name),
+        __entry->on ? "throttle" : "unthrottle", __entry->queued)
+);
+
+/* Readers were woken up with queued bytes in the read ring */
+TRACE_EVENT(n_touch_wakeup,
+    TP_PROTO(struct tty_struct *tty, unsigned int queued),
+    TP_ARGS(tty, queued),
+    TP_STRUCT__entry(
+        __string(name, tty->name)
+        __field(unsigned int, queued)
+    ),
+    TP_fast_assign(
+        __assign_str(name, tty->name);
+        __entry->queued = queued;
+    ),
+    TP_printk("%s queued %u", __get_str(name), __entry->queued)
+);
+
+/* n_touch_read() returned ret to user space */
+TRACE_EVENT(n_touch_read,
+    TP_PROTO(struct tty_struct *tty, ssize_t ret),
+    TP_ARGS(tty, ret),
+    TP_STRUCT__entry(
+        __string(name, tty->name)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(name, tty->name);
+        __entry->ret = ret;
+    ),
+    TP_printk("%s ret %zd", __get_str(name), __entry->ret)
+);
+
+#endif /* _N_TOUCH_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE n_touch_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "n_touch.h"
+
+/* Replay harness for the N_TCH line discipline. Attaches N_TCH to the
+ * slave side of a pty and writes a touch controller byte stream into
+ * the master side, so ld_touchpad.c can be tested and benchmarked
+ * without a controller:
+ *
+ * touch_replay [options] [capture file]
+ *
+ *   -l ldisc    Line discipline ID of N_TCH
+ *   -p size     Packet size of the controller, PACKET_SIZE
+ *   -H header   Header byte, TOUCH_PKT_HEADER
+ *   -n packets  Packets to generate when no capture file is given
+ *   -r rate     Bytes/sec to write, 0 for as fast as possible
+ *   -T          Replay a capture at its recorded timing instead
+ *   -P port     Replay only this port of a capture
+ *   -b bytes    Bytes per write()
+ *   -c permille Corrupt this many bytes per thousand
+ *   -s seed     Seed for the generator and the corruption
+ *
+ * The capture file is either raw controller bytes or the format
+ * written by the capture tool in userspace.c (a "TCAP" header, then
+ * struct cap_record and data per chunk). Without one, a stream of
+ * packets is generated whose coordinates carry a sequence number,
+ * which gives end-to-end latency from write() to read(). The tty is
+ * read in TOUCH_MODE_RECORD mode, which also gives the latency from
+ * arrival in the line discipline to read(). Reports packets/sec,
+ * bytes/sec, p50/p99 latencies and the line discipline's statistics.
+ * The same seed produces the same stream */
+
+#ifndef N_TCH
+#define N_TCH       20
+#endif
+
+static int pkt_size = 5;
+static int pkt_header = 0x80;
+static int rate, timed, chunk = 64, corrupt;
+static long port = -1;
+
+static unsigned char *stream;   /* Bytes to write */
+static long long *when;         /* Recorded ns of each byte, -T only */
+static size_t stream_len;
+static long long *sent;         /* write() time per generated packet */
+static long nr_sent;
+static long corrupted;
+static volatile int writer_done;
+static int master;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long ns)
+{
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void append(unsigned char c, long long t)
+{
+    static size_t size;
+
+    if (stream_len == size) {
+        size = size ? 2 * size : 4096;
+        stream = realloc(stream, size);
+        when = realloc(when, size * sizeof(*when));
+    }
+    when[stream_len] = t;
+    stream[stream_len++] = c;
+}
+
+/* Generate n packets. X and Y carry the sequence number. Bit 0 of
+ * the header is the touch state: every packet is a touch but the
+ * last, which releases */
+static void generate(long n)
+{
+    long i;
+    int j;
+
+    for (i = 0; i < n; i++) {
+        append((pkt_header & 0xFE) | (i < n - 1), 0);
+        append((i >> 7) & 0x7F, 0);
+        append(i & 0x7F, 0);
+        append((i >> 21) & 0x7F, 0);
+        append((i >> 14) & 0x7F, 0);
+        for (j = 5; j < pkt_size; j++) append(rand() & 0x7F, 0);
+    }
+}
+
+/* Load a capture file, or raw bytes if it has no header */
+static int load(const char *path)
+{
+    struct cap_record rec;
+    unsigned char buf[4096];
+    char magic[8];
+    FILE *f;
+    size_t n, i;
+
+    if (!(f = fopen(path, "rb"))) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CAP_MAGIC, 4)) {
+        /* Raw controller bytes */
+        rewind(f);
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            for (i = 0; i < n; i++) append(buf[i], 0);
+        fclose(f);
+        return 0;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        while (rec.len) {
+            n = fread(buf, 1, rec.len < sizeof(buf) ? rec.len : sizeof(buf),
+                    f);
+            if (!n) break;
+            if (port < 0 || rec.port == port)
+                for (i = 0; i < n; i++) append(buf[i], rec.timestamp);
+            rec.len -= n;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Flip a bit, drop the byte or insert a stray one, in corrupt bytes
+ * per thousand */
+static void mangle(void)
+{
+    unsigned char *out = malloc(2 * stream_len + 1);
+    long long *out_when = malloc((2 * stream_len + 1) * sizeof(*when));
+    size_t i, n = 0;
+
+    for (i = 0; i < stream_len; i++) {
+        out_when[n] = when[i];
+        if (rand() % 1000 >= corrupt) {
+            out[n++] = stream[i];
+            continue;
+        }
+        corrupted++;
+        switch (rand() % 3) {
+        case 0:
+            out[n++] = stream[i] ^ (1 << (rand() % 8));
+            break;
+        case 1:
+            break;
+        case 2:
+            out[n++] = rand();
+            out_when[n] = when[i];
+            out[n++] = stream[i];
+            break;
+        }
+    }
+    free(stream);
+    free(when);
+    stream = out;
+    when = out_when;
+    stream_len = n;
+}
+
+/* Write the stream into the pty master at the requested pace */
+static void *writer(void *arg __attribute__((unused)))
+{
+    long long start = now_ns(), t;
+    size_t off = 0, n;
+    ssize_t ret;
+
+    while (off < stream_len) {
+        n = stream_len - off < (size_t)chunk ? stream_len - off :
+            (size_t)chunk;
+        if (timed) {
+            /* Chunk ends where the recording moved on */
+            for (n = 1; off + n < stream_len && n < (size_t)chunk &&
+                    when[off + n] == when[off]; n++)
+                ;
+            sleep_until(start + when[off] - when[0]);
+        } else if (rate) {
+            sleep_until(start + off * 1000000000LL / rate);
+        }
+
+        /* Blocks while N_TCH has the pty throttled */
+        t = now_ns();
+        if ((ret = write(master, stream + off, n)) <= 0) {
+            perror("write");
+            break;
+        }
+        off += ret;
+
+        /* Generated packets completed by this write */
+        if (sent) {
+            while ((nr_sent + 1) * pkt_size <= (long)off)
+                sent[nr_sent++] = t;
+        }
+    }
+
+    writer_done = 1;
+    return NULL;
+}
+
+/* Drain whatever N_TCH writes back to the controller */
+static void drain_master(void)
+{
+    struct pollfd pfd = { master, POLLIN, 0 };
+    char buf[256];
+
+    while (poll(&pfd, 1, 0) > 0 && read(master, buf, sizeof(buf)) > 0)
+        ;
+}
+
+int main(int argc, char *argv[])
+{
+    int ldisc = N_TCH, mode = TOUCH_MODE_RECORD, slave, opt, i;
+    long packets = 100000, got = 0, nr_lat = 0, nr_e2e = 0, seq;
+    long long start, last, t, *lat, *e2e;
+    struct touch_stats stats;
+    struct touch_record *buf, *rec;
+    struct pollfd pfd;
+    pthread_t tid;
+    ssize_t n;
+
+    while ((opt = getopt(argc, argv, "l:p:H:n:r:TP:b:c:s:")) != -1) {
+        switch (opt) {
+        case 'l': ldisc = atoi(optarg); break;
+        case 'p': pkt_size = atoi(optarg); break;
+        case 'H': pkt_header = strtol(optarg, NULL, 0); break;
+        case 'n': packets = atol(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'T': timed = 1; break;
+        case 'P': port = atol(optarg); break;
+        case 'b': chunk = atoi(optarg); break;
+        case 'c': corrupt = atoi(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        default:
+            fprintf(stderr, "usage: %s [-l ldisc] [-p size] [-H header] "
+                    "[-n packets] [-r rate] [-T] [-P port] [-b bytes] "
+                    "[-c permille] [-s seed] [capture file]\n", argv[0]);
+            exit(-1);
+        }
+    }
+    if (pkt_size < 5 || chunk <= 0 || packets <= 0) {
+        fprintf(stderr, "bad packet size, chunk or packet count\n");
+        exit(-1);
+    }
+
+    if (optind < argc) {
+        if (load(argv[optind])) exit(-1);
+    } else {
+        generate(packets);
+        sent = calloc(packets, sizeof(*sent));
+    }
+    if (corrupt) {
+        mangle();
+        /* Packets no longer line up with write offsets */
+        free(sent);
+        sent = NULL;
+    }
+    if (!stream_len) {
+        fprintf(stderr, "nothing to replay\n");
+        exit(-1);
+    }
+
+    /* pty pair with N_TCH on the slave */
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+            grantpt(master) || unlockpt(master)) {
+        perror("pty");
+        exit(-1);
+    }
+    if ((slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+        perror(ptsname(master));
+        exit(-1);
+    }
+    if (ioctl(slave, TIOCSETD, &ldisc) < 0) {
+        perror("TIOCSETD");
+        exit(-1);
+    }
+    if (ioctl(slave, TOUCH_IOC_MODE, &mode) < 0) {
+        perror("TOUCH_IOC_MODE");
+        exit(-1);
+    }
+
+    buf = malloc(256 * sizeof(*buf));
+    lat = malloc((stream_len / pkt_size + 1) * sizeof(*lat));
+    e2e = malloc((stream_len / pkt_size + 1) * sizeof(*e2e));
+
+    start = last = now_ns();
+    pthread_create(&tid, NULL, writer, NULL);
+
+    pfd.fd = slave;
+    pfd.events = POLLIN;
+    while (1) {
+        drain_master();
+        if (poll(&pfd, 1, writer_done ? 500 : 100) <= 0) {
+            if (writer_done) break;
+            continue;
+        }
+        if ((n = read(slave, buf, 256 * sizeof(*buf))) <= 0) break;
+        last = t = now_ns();
+
+        for (rec = buf; rec < buf + n / sizeof(*buf); rec++, got++) {
+            lat[nr_lat++] = t - (long long)rec->timestamp;
+            if (!sent) continue;
+            seq = rec->x | (long)rec->y << 14;
+            if (seq < nr_sent) e2e[nr_e2e++] = t - sent[seq];
+        }
+    }
+    pthread_join(tid, NULL);
+    /* Up to the last packet read, not the wait for stragglers */
+    if (last == start) last++;
+
+    memset(&stats, 0, sizeof(stats));
+    ioctl(slave, TOUCH_IOC_STATS, &stats);
+
+    printf("%ld bytes, %ld corrupted, %ld packets read\n",
+            (long)stream_len, corrupted, got);
+    printf("%.0f packets/sec  %.0f bytes/sec\n", got * 1e9 / (last - start),
+            stream_len * 1e9 / (last - start));
+    if (nr_lat) {
+        qsort(lat, nr_lat, sizeof(*lat), cmp_ns);
+        printf("ldisc to read  p50 %9lld ns  p99 %9lld ns\n",
+                lat[nr_lat / 2], lat[nr_lat * 99 / 100]);
+    }
+    if (nr_e2e) {
+        qsort(e2e, nr_e2e, sizeof(*e2e), cmp_ns);
+        printf("write to read  p50 %9lld ns  p99 %9lld ns\n",
+                e2e[nr_e2e / 2], e2e[nr_e2e * 99 / 100]);
+    }
+    printf("parsed %llu  parse errors %llu  overruns %llu  filtered %llu  "
+            "throttles %llu\n", (unsigned long long)stats.packets,
+            (unsigned long long)stats.parse_errors,
+            (unsigned long long)stats.overruns,
+            (unsigned long long)stats.filtered,
+            (unsigned long long)stats.throttles);
+
+    /* Back to N_TTY */
+    i = 0;
+    ioctl(slave, TIOCSETD, &i);
+    return 0;
+}
@@ -1,9 +1,233 @@
-fd = open("/dev/ttySX", O_RDONLY | O_NOCTTY);
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/serial.h>
 
-/* At this point, N_TCH is attached to /dev/ttySX, the serial port used
- * by the touch controller. Switch to N_TTY */
-ldisc = N_TTY;
-ioctl(fd, TIOCSETD, &ldisc);
+#include "n_touch.h"
 
-/* Set termios to raw mode and dump the data coming in */
-/* ... */
+/* Raw capture of the touch controller's serial ports. For each port,
+ * N_TCH is swapped for N_TTY and termios set to raw mode, then the
+ * data coming in is dumped to a capture file:
+ *
+ * userspace [-o file] [-s seconds] tty...
+ *
+ * All ports are watched with one epoll set. VMIN is set to its
+ * largest value, so a busy port wakes us up once per 255 bytes rather
+ * than per byte, and every CAP_SWEEP_MS the ports are read regardless
+ * to pick up the tail of a burst. Reads go into one large arena, and
+ * each round of reads is written to disk with a single writev().
+ *
+ * The file is the format touch_replay reads: a "TCAP" header, then a
+ * struct cap_record with the arrival time and port index (position on
+ * the command line) ahead of each chunk read. Replay one port with
+ * touch_replay -T -P port file */
+
+#define CAP_MAX_PORTS   16
+#define CAP_ARENA       (1024 * 1024)   /* Data per writev() */
+#define CAP_READ        65536           /* Largest single read() */
+#define CAP_SWEEP_MS    10
+
+struct cap_port {
+    const char *name;
+    int fd;
+    struct termios saved;
+    struct serial_icounter_struct icount;   /* At start */
+    unsigned long long bytes;
+};
+
+static struct cap_port ports[CAP_MAX_PORTS];
+static int nr_ports;
+static volatile sig_atomic_t stop;
+
+/* Pending output: record headers and the arena their data is in */
+static unsigned char arena[CAP_ARENA];
+static size_t arena_len;
+static struct cap_record recs[IOV_MAX / 2];
+static struct iovec iov[IOV_MAX];
+static int nr_recs;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void on_signal(int sig __attribute__((unused)))
+{
+    stop = 1;
+}
+
+/* Write out the pending records */
+static void flush(int out)
+{
+    if (nr_recs && writev(out, iov, 2 * nr_recs) < 0) {
+        perror("writev");
+        stop = 1;
+    }
+    nr_recs = 0;
+    arena_len = 0;
+}
+
+/* Read whatever the port has into the arena */
+static void drain(struct cap_port *p, int out)
+{
+    struct cap_record *rec;
+    ssize_t n;
+
+    while (1) {
+        if (nr_recs == IOV_MAX / 2 || CAP_ARENA - arena_len < CAP_READ)
+            flush(out);
+        n = read(p->fd, arena + arena_len, CAP_READ);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN) {
+                perror(p->name);
+                stop = 1;
+            }
+            return;
+        }
+
+        rec = &recs[nr_recs];
+        rec->timestamp = now_ns();
+        rec->port = p - ports;
+        rec->len = n;
+        iov[2 * nr_recs].iov_base = rec;
+        iov[2 * nr_recs].iov_len = sizeof(*rec);
+        iov[2 * nr_recs + 1].iov_base = arena + arena_len;
+        iov[2 * nr_recs + 1].iov_len = n;
+        nr_recs++;
+        arena_len += n;
+        p->bytes += n;
+    }
+}
+
+/* Switch the port to N_TTY in raw mode */
+static int setup(struct cap_port *p)
+{
+    struct termios tio;
+    int ldisc = N_TTY;
+
+    if ((p->fd = open(p->name, O_RDONLY | O_NOCTTY | O_NONBLOCK)) < 0) {
+        perror(p->name);
+        return -1;
+    }
+
+    /* At this point, N_TCH may be attached to the serial port used
+     * by the touch controller. Switch to N_TTY */
+    if (ioctl(p->fd, TIOCSETD, &ldisc) < 0) {
+        perror("TIOCSETD");
+        return -1;
+    }
+
+    /* Raw mode, keeping the baud rate. Readable at VMIN bytes */
+    tcgetattr(p->fd, &p->saved);
+    tio = p->saved;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CREAD | CLOCAL;
+    tio.c_cc[VMIN] = 255;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(p->fd, TCSANOW, &tio) < 0) {
+        perror("tcsetattr");
+        return -1;
+    }
+    tcflush(p->fd, TCIFLUSH);
+
+    /* Serial drivers count overruns, ptys don't */
+    ioctl(p->fd, TIOCGICOUNT, &p->icount);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "capture.tcap";
+    struct serial_icounter_struct icount;
+    struct epoll_event ev, events[CAP_MAX_PORTS];
+    unsigned char header[8];
+    uint32_t version = CAP_VERSION;
+    long long end = 0, t, sweep;
+    int opt, ep, out, i, n;
+
+    while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+        switch (opt) {
+        case 'o': path = optarg; break;
+        case 's': end = now_ns() + atoll(optarg) * 1000000000LL; break;
+        default: optind = argc; break;
+        }
+    }
+    if (optind >= argc || argc - optind > CAP_MAX_PORTS) {
+        fprintf(stderr, "usage: %s [-o file] [-s seconds] tty...\n",
+                argv[0]);
+        exit(-1);
+    }
+
+    if ((ep = epoll_create(CAP_MAX_PORTS)) < 0) {
+        perror("epoll_create");
+        exit(-1);
+    }
+    for (i = optind; i < argc; i++) {
+        ports[nr_ports].name = argv[i];
+        if (setup(&ports[nr_ports])) exit(-1);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &ports[nr_ports];
+        epoll_ctl(ep, EPOLL_CTL_ADD, ports[nr_ports].fd, &ev);
+        nr_ports++;
+    }
+
+    if ((out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(path);
+        exit(-1);
+    }
+    memcpy(header, CAP_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    if (write(out, header, sizeof(header)) != sizeof(header)) {
+        perror(path);
+        exit(-1);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    sweep = now_ns() + CAP_SWEEP_MS * 1000000LL;
+    while (!stop) {
+        t = now_ns();
+        if (end && t >= end) break;
+
+        n = epoll_wait(ep, events, CAP_MAX_PORTS,
+                t < sweep ? (int)((sweep - t) / 1000000) + 1 : 0);
+        for (i = 0; i < n; i++) drain(events[i].data.ptr, out);
+
+        /* Pick up data short of VMIN */
+        if (now_ns() >= sweep) {
+            for (i = 0; i < nr_ports; i++) drain(&ports[i], out);
+            sweep = now_ns() + CAP_SWEEP_MS * 1000000LL;
+        }
+        flush(out);
+    }
+    flush(out);
+    close(out);
+
+    for (i = 0; i < nr_ports; i++) {
+        printf("%s: %llu bytes", ports[i].name, ports[i].bytes);
+        if (!ioctl(ports[i].fd, TIOCGICOUNT, &icount))
+            printf(", %d overruns, %d buffer overruns",
+                    icount.overrun - ports[i].icount.overrun,
+                    icount.buf_overrun - ports[i].icount.buf_overrun);
+        printf("\n");
+        tcsetattr(ports[i].fd, TCSANOW, &ports[i].saved);
+        close(ports[i].fd);
+    }
+    return 0;
+}
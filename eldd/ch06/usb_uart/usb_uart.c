@@ -4,12 +4,13 @@
 #include <linux/tty_flip.h>
 #include <linux/serial_core.h>
 #include <linux/serial.h>
+#include <linux/hrtimer.h>
 #include <asm/irq.h>
 #include <asm/io.h>
 
 #define USB_UART_MAJOR	200	/* You have to get this assigned */
 #define USB_UART_MINOR_START	70	/* Start minor numbering here */
-#define USB_UART_PORT	2	/* The phone has 2 USB_UARTS */
+#define USB_UART_PORTS	2	/* The phone has 2 USB_UARTS */
 #define PORT_USB_UART	30	/* UART type. Add this to include/linux/serial_core.h*/
 
 
@@ -25,15 +26,51 @@
 #define USB_UART_TX_FULL	0x20	/* TX FIFO is full */
 #define USB_UART_RX_EMPTY	0x10	/* TX FIFO is empty */
 #define USB_UART_STATUS		0x0F	/* Parity/frame/overruns? */
+#define USB_UART_PARITY_ERR	0x01	/* Byte at the FIFO head has bad parity */
+#define USB_UART_FRAME_ERR	0x02	/* ... a framing error */
+#define USB_UART_OVERRUN	0x04	/* RX FIFO overflowed */
+#define USB_UART_BREAK		0x08	/* Break received */
+#define USB_UART_TX_EMPTY	0x40	/* TX FIFO is empty */
+
+/* Interrupt enables, written to the status register offset.
+ * Datasheet-dependent */
+#define USB_UART_IE_RX		0x01	/* RX data available */
+#define USB_UART_IE_TX		0x02	/* TX FIFO empty */
 
 #define USB_UART1_IRQ	3	/* USB_UART1 IRQ */
 #define USB_UART2_IRQ	4	/* USB_UART2 IRQ */
 #define USB_UART_FIFO_SIZE	32	/* FIFO size */
 #define USB_UART_CLK_FREQ	16000000
+#define USB_UART_RATE_WINDOW	(10 * NSEC_PER_MSEC)	/* RX rate sampling */
 
 static struct uart_port usb_uart_port[]; /* Defined later on */
+static unsigned char usb_uart_ier[USB_UART_PORTS]; /* Enabled interrupts */
+
+/* Hybrid RX, one per port. Above poll_on chars/sec the RX interrupt
+ * is masked and the FIFO polled from an hrtimer at about the rate it
+ * fills. Below poll_off chars/sec the port goes back to interrupts.
+ * poll_on == 0 keeps the port in interrupt mode. Otherwise poll_off
+ * must be non-zero, or the port would never leave polled mode, and
+ * may not exceed poll_on, or it would flip modes on every rate
+ * window. Tunable through sysfs, see usb_uart_attrs[] */
+struct usb_uart_rx {
+    struct uart_port *port;
+    struct hrtimer timer;
+    ktime_t period;         /* Poll interval */
+    int polling;            /* 0: interrupt mode, 1: polled mode */
+    unsigned int poll_on;   /* Thresholds, chars/sec */
+    unsigned int poll_off;
+    unsigned long chars;    /* Received in the current rate window */
+    ktime_t window;         /* Start of the rate window */
+    ktime_t since;          /* Start of the current mode */
+    u64 mode_ns[2];         /* Time spent in each mode */
+    unsigned long switches; /* Mode changes */
+};
+
+static struct usb_uart_rx usb_uart_rx[USB_UART_PORTS];
 
-/* Write a character to the USB_UART port */
+/* Write a character to the USB_UART port, polling. Regular
+ * transmission is interrupt driven, see usb_uart_tx_chars() */
 static void usb_uart_putc(struct uart_port *port, unsigned char c)
 {
      /* Write until there is space in the TX FIFO of the USB_UART.
@@ -45,20 +82,40 @@ static void usb_uart_putc(struct uart_port *port, unsigned char c)
     __raw_writeb(c, (port->membase+1));
 }
 
-/* Read a character from the USB_UART */
+/* Read the character at the head of the RX FIFO. The caller has
+ * seen USB_UART_RX_EMPTY clear */
 static unsigned char usb_uart_getc(struct uart_port *port)
 {
-    /* Wait until data is available in the RX_FIFO */
-    while (__raw_readb(port->membase) & USB_UART_RX_EMPTY);
-
-    /* Obtain the data */
     return (__raw_readb(port->membase+2));
 }
 
-/* Obtain USB_UART status */
+/* Obtain USB_UART status, including the RX_EMPTY and TX_FULL bits */
 static unsigned char usb_uart_status(struct uart_port *port)
 {
-    return (__raw_readb(port->membase) & USB_UART_STATUS);
+    return (__raw_readb(port->membase));
+}
+
+/* Translate the error bits of a status read into the tty flag of the
+ * character at the head of the RX FIFO, and account for it */
+static char usb_uart_flag(struct uart_port *port, unsigned char status)
+{
+    if (status & USB_UART_BREAK) {
+        port->icount.brk++;
+        return TTY_BREAK;
+    }
+    if (status & USB_UART_PARITY_ERR) {
+        port->icount.parity++;
+        return TTY_PARITY;
+    }
+    if (status & USB_UART_FRAME_ERR) {
+        port->icount.frame++;
+        return TTY_FRAME;
+    }
+    if (status & USB_UART_OVERRUN) {
+        port->icount.overrun++;
+        return TTY_OVERRUN;
+    }
+    return TTY_NORMAL;
 }
 
 /*
@@ -94,26 +151,203 @@ static void usb_uart_config_port(struct uart_port *port, int flags)
     }
 }
 
-/* Receive interrupt handler */
-static irqreturn_t usb_uart_rxint(int irq, void *dev_id)
+/* Enable and disable interrupt sources. Called with port->lock held */
+static void usb_uart_irq_on(struct uart_port *port, unsigned char ie)
+{
+    usb_uart_ier[port->line] |= ie;
+    __raw_writeb(usb_uart_ier[port->line], port->membase);
+}
+
+static void usb_uart_irq_off(struct uart_port *port, unsigned char ie)
+{
+    usb_uart_ier[port->line] &= ~ie;
+    __raw_writeb(usb_uart_ier[port->line], port->membase);
+}
+
+/* Stop transmitting. Called with port->lock held */
+static void usb_uart_stop_tx(struct uart_port *port)
+{
+    usb_uart_irq_off(port, USB_UART_IE_TX);
+}
+
+/* Refill the TX FIFO from the UART circular buffer. Called with
+ * port->lock held when the FIFO is empty, so up to fifosize bytes
+ * go in without checking USB_UART_TX_FULL */
+static void usb_uart_tx_chars(struct uart_port *port)
+{
+    struct circ_buf *xmit = &port->info->xmit;
+    int count = port->fifosize;
+
+    /* XON/XOFF goes ahead of the data */
+    if (port->x_char) {
+        __raw_writeb(port->x_char, (port->membase+1));
+        port->icount.tx++;
+        port->x_char = 0;
+        count--;
+    }
+    if (uart_circ_empty(xmit) || uart_tx_stopped(port)) {
+        usb_uart_stop_tx(port);
+        return;
+    }
+
+    while (count-- > 0) {
+        /* Write to the USB_UART's WRITE_DATA register */
+        __raw_writeb(xmit->buf[xmit->tail], (port->membase+1));
+        xmit->tail = (xmit->tail + 1) & (UART_XMIT_SIZE - 1);
+        port->icount.tx++;
+        if (uart_circ_empty(xmit)) break;
+    }
+
+    /* Let writers refill the buffer once it runs low */
+    if (uart_circ_chars_pending(xmit) < WAKEUP_CHARS)
+        uart_write_wakeup(port);
+
+    /* Nothing left, no need for the next TX-empty interrupt */
+    if (uart_circ_empty(xmit)) usb_uart_stop_tx(port);
+}
+
+/* Receive characters. Returns the number received */
+static int usb_uart_rx_chars(struct uart_port *port)
 {
-    struct uart_port *port = (struct uart_port *) dev_id;
     struct tty_struct *tty = port->info->tty;
+    unsigned char buf[USB_UART_FIFO_SIZE];
+    unsigned char status;
+    int n, done, total = 0;
 
-    unsigned int status, data;
     /* ... */
-    do {
-        /* ... */
-        /* Read data */
-        data = usb_uart_getc(port);
-        /* Normal, overrun, parity, frame error? */
-        status = usb_uart_status(port);
+    /* Drain the RX FIFO in bursts of up to a FIFO's worth. There is
+     * no FIFO level register, so one status read ahead of each data
+     * read tells both whether a character is waiting and whether it
+     * arrived with an error. Clean runs are collected and handed to
+     * the tty layer in one call */
+    status = usb_uart_status(port);
+    while (!(status & USB_UART_RX_EMPTY)) {
+        n = 0;
+        do {
+            if (status & USB_UART_STATUS) {
+                /* Normal, overrun, parity, frame error? Only now
+                 * work out the flag, after the clean run before it */
+                done = tty_insert_flip_string(tty, buf, n);
+                port->icount.buf_overrun += n - done;
+                port->icount.rx += n;
+                total += n + 1;
+                n = 0;
+                tty_insert_flip_char(tty, usb_uart_getc(port),
+                        usb_uart_flag(port, status));
+                port->icount.rx++;
+            } else {
+                buf[n++] = usb_uart_getc(port);
+            }
+            status = usb_uart_status(port);
+        } while (!(status & USB_UART_RX_EMPTY) && n < USB_UART_FIFO_SIZE);
+
         /* Dispatch to the tty layer */
-        tty_insert_flip_char(tty, data, status);
-        /* ... */
-    } while (more_chars_to_be_read()); /* More chars */
+        done = tty_insert_flip_string(tty, buf, n);
+        port->icount.buf_overrun += n - done;
+        port->icount.rx += n;
+        total += n;
+    }
     /* ... */
     tty_flip_buffer_push(tty);
+    return total;
+}
+
+/* Account for n received characters. Returns 1 and the rate in
+ * chars/sec once a rate window is complete */
+static int usb_uart_rx_rate(struct usb_uart_rx *rx, int n,
+        unsigned long *rate)
+{
+    ktime_t now = ktime_get();
+    s64 elapsed = ktime_to_ns(ktime_sub(now, rx->window));
+
+    rx->chars += n;
+    if (elapsed < USB_UART_RATE_WINDOW) return 0;
+    *rate = div64_u64((u64)rx->chars * NSEC_PER_SEC, elapsed);
+    rx->chars = 0;
+    rx->window = now;
+    return 1;
+}
+
+/* Switch between interrupt and polled RX. Called with port->lock
+ * held */
+static void usb_uart_rx_mode(struct usb_uart_rx *rx, int polling)
+{
+    struct uart_port *port = rx->port;
+    ktime_t now = ktime_get();
+    unsigned int baud, chars;
+
+    rx->mode_ns[rx->polling] += ktime_to_ns(ktime_sub(now, rx->since));
+    rx->since = now;
+    rx->polling = polling;
+    rx->switches++;
+
+    if (!polling) {
+        usb_uart_irq_on(port, USB_UART_IE_RX);
+        return;
+    }
+
+    /* Poll by the time the FIFO is three quarters full, at 10 bits
+     * per character */
+    baud = tty_get_baud_rate(port->info->tty);
+    if (!baud) baud = 9600;
+    chars = max(port->fifosize * 3 / 4, 1U);
+    rx->period = ns_to_ktime(div_u64((u64)chars * 10 * NSEC_PER_SEC, baud));
+
+    usb_uart_irq_off(port, USB_UART_IE_RX);
+    hrtimer_start(&rx->timer, rx->period, HRTIMER_MODE_REL);
+}
+
+/* Poll the RX FIFO in polled mode */
+static enum hrtimer_restart usb_uart_rx_poll(struct hrtimer *timer)
+{
+    struct usb_uart_rx *rx = container_of(timer, struct usb_uart_rx, timer);
+    struct uart_port *port = rx->port;
+    unsigned long flags, rate;
+    int n;
+
+    n = usb_uart_rx_chars(port);
+    if (!rx->poll_on ||
+            (usb_uart_rx_rate(rx, n, &rate) && rate < rx->poll_off)) {
+        /* Polling turned off or traffic dropped, back to interrupts */
+        spin_lock_irqsave(&port->lock, flags);
+        usb_uart_rx_mode(rx, 0);
+        spin_unlock_irqrestore(&port->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_forward_now(timer, rx->period);
+    return HRTIMER_RESTART;
+}
+
+/* Interrupt handler. One line signals both RX data available and
+ * TX FIFO empty */
+static irqreturn_t usb_uart_int(int irq, void *dev_id)
+{
+    struct uart_port *port = (struct uart_port *) dev_id;
+    struct usb_uart_rx *rx = &usb_uart_rx[port->line];
+    unsigned char status = usb_uart_status(port);
+    unsigned long rate;
+    int n;
+
+    /* In polled mode the hrtimer owns the RX FIFO */
+    if (!rx->polling && !(status & USB_UART_RX_EMPTY)) {
+        n = usb_uart_rx_chars(port);
+        if (usb_uart_rx_rate(rx, n, &rate) && rx->poll_on &&
+                rate >= rx->poll_on) {
+            /* Traffic picked up, mask RX and poll */
+            spin_lock(&port->lock);
+            usb_uart_rx_mode(rx, 1);
+            spin_unlock(&port->lock);
+        }
+    }
+
+    /* Read the status again under the lock: usb_uart_start_tx() may
+     * have filled the FIFO while RX was being drained */
+    spin_lock(&port->lock);
+    if ((usb_uart_ier[port->line] & USB_UART_IE_TX) &&
+            (usb_uart_status(port) & USB_UART_TX_EMPTY))
+        usb_uart_tx_chars(port);
+    spin_unlock(&port->lock);
 
     return IRQ_HANDLED;
 }
@@ -121,13 +355,24 @@ static irqreturn_t usb_uart_rxint(int irq, void *dev_id)
 /* Called when an application opens a USB_UART */
 static void usb_uart_startup(struct uart_port *port)
 {
+    unsigned long flags;
     int retval = 0;
     /* ... */
     /* Request IRQ */
-    if ((retval = request_irq(port->irq, usb_uart_rxint, 0,
+    if ((retval = request_irq(port->irq, usb_uart_int, 0,
                     "usb_uart", (void *)port))) {
         return retval;
     }
+
+    /* Receive under interrupts. TX interrupts are enabled by
+     * usb_uart_start_tx() while there is data to send */
+    spin_lock_irqsave(&port->lock, flags);
+    usb_uart_rx[port->line].polling = 0;
+    usb_uart_rx[port->line].chars = 0;
+    usb_uart_rx[port->line].window = ktime_get();
+    usb_uart_rx[port->line].since = usb_uart_rx[port->line].window;
+    usb_uart_irq_on(port, USB_UART_IE_RX);
+    spin_unlock_irqrestore(&port->lock, flags);
     /* ... */
     return retval;
 }
@@ -135,12 +380,36 @@ static void usb_uart_startup(struct uart_port *port)
 /* Called when an application closes a USB_UART */
 static void usb_uart_shutdown(struct uart_port *port)
 {
-    /* ... */
-    /* Free IRQ */
-    free_irq(port->irq, port);
+    struct usb_uart_rx *rx = &usb_uart_rx[port->line];
+    unsigned long flags;
+    ktime_t now;
 
+    /* ... */
     /* Disable interrupts by writing to appropriate 
-     * registers */
+     * registers, and let a running handler finish */
+    spin_lock_irqsave(&port->lock, flags);
+    usb_uart_irq_off(port, USB_UART_IE_RX | USB_UART_IE_TX);
+    spin_unlock_irqrestore(&port->lock, flags);
+    synchronize_irq(port->irq);
+
+    /* Stop polling. Going back to interrupt mode, the poll callback
+     * may have turned RX interrupts on again, so mask them once more
+     * now that nothing else can */
+    hrtimer_cancel(&rx->timer);
+    spin_lock_irqsave(&port->lock, flags);
+    usb_uart_irq_off(port, USB_UART_IE_RX | USB_UART_IE_TX);
+
+    /* Close the books on the current mode. Not through
+     * usb_uart_rx_mode(), which would turn the RX interrupt back on
+     * and count a switch that never happened */
+    now = ktime_get();
+    rx->mode_ns[rx->polling] += ktime_to_ns(ktime_sub(now, rx->since));
+    rx->since = now;
+    rx->polling = 0;
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    /* Free IRQ, now that nothing can raise it */
+    free_irq(port->irq, port);
     /* ... */
 }
 
@@ -150,28 +419,28 @@ static const char * usb_uart_type(struct uart_port *port)
     return port->type == PORT_USB_UART ? "USB_UART" : NULL;
 }
 
-/* Start transmitting bytes */
+/* Start transmitting bytes. Called by the serial core with
+ * port->lock held. Fill the FIFO now if it is idle; the TX-empty
+ * interrupt refills it until the UART circular buffer runs dry */
 static void usb_uart_start_tx(struct uart_port *port)
 {
-    while(1) {
-        /* Get the data from the UART circular buffer and
-         * write it to the USB_UART's WRITE_DATA register */
-        usb_uart_putc(port,
-                port->info->xmit.buf[port->info->xmit.tail]);
-        /* Adjust the tail of the UART buffer */
-        port->info->xmit.tail = (port->info->xmit.tail + 1) &
-            (UART_XMIT_SIZE - 1);
-        /* Statistics */
-        port->icount.tx++;
-        /* Finish if no more data available in the UART buffer */
-        if (uart_circ_empty(&port->info->xmit)) break;
-    }
-    /* ... */
+    if (usb_uart_ier[port->line] & USB_UART_IE_TX) return;
+    usb_uart_irq_on(port, USB_UART_IE_TX);
+    if (usb_uart_status(port) & USB_UART_TX_EMPTY)
+        usb_uart_tx_chars(port);
+}
+
+/* Transmitter busy? */
+static unsigned int usb_uart_tx_empty(struct uart_port *port)
+{
+    return (usb_uart_status(port) & USB_UART_TX_EMPTY) ? TIOCSER_TEMT : 0;
 }
 
 /* The UART operations structure */
 static struct uart_ops usb_uart_ops = {
     .start_tx   =   usb_uart_start_tx,  /* Start transmitting */
+    .stop_tx  =   usb_uart_stop_tx, /* Stop transmission */
+    .tx_empty   =   usb_uart_tx_empty,  /* Transmitter busy? */
     .startup   =   usb_uart_startup,  /* App opens USB_UART */
     .shutdown   =   usb_uart_shutdown,  /* App closes USB_UART */
     .type   =   usb_uart_type,  /* Set UART type */
@@ -182,10 +451,8 @@ static struct uart_ops usb_uart_ops = {
     .release_port   =   usb_uart_release_port,  /* Release resources associated with a
                                                    USB_UART port */
 #if 0 /* Left unimplemented for the USB_UART */
-    .tx_empty   =   usb_uart_tx_empty,  /* Transmitter busy? */
     .set_mctrl  =   usb_uart_set_mctrl, /* Set modem control */
     .get_mctrl  =   usb_uart_get_mctrl, /* Get modem control */
-    .stop_tx  =   usb_uart_stop_tx, /* Stop transmission */
     .stop_rx  =   usb_uart_stop_rx, /* Stop reception */
     .enable_ms  =   usb_uart_enable_ms, /* Enable modem status signals */
     .set_termios  =   usb_uart_set_termios, /* Set termios */
@@ -204,9 +471,109 @@ static struct uart_driver usb_uart_reg = {
                                         12, "Video Drivers" */
 };
 
+/* Sysfs methods for the hybrid RX thresholds and accounting, under
+ * /sys/devices/platform/usb_uart.N/ */
+static ssize_t show_rx_poll_on(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    struct uart_port *port = dev_get_drvdata(dev);
+
+    return sprintf(buffer, "%u\n", usb_uart_rx[port->line].poll_on);
+}
+
+static ssize_t store_rx_poll_on(struct device *dev,
+        struct device_attribute *attr, const char *buffer, size_t count)
+{
+    struct uart_port *port = dev_get_drvdata(dev);
+    struct usb_uart_rx *rx = &usb_uart_rx[port->line];
+    unsigned long flags;
+    unsigned int val;
+    int ret = count;
+
+    if (sscanf(buffer, "%u", &val) != 1) return -EINVAL;
+
+    /* Keep 0 < poll_off <= poll_on */
+    spin_lock_irqsave(&port->lock, flags);
+    if (val && (!rx->poll_off || val < rx->poll_off))
+        ret = -EINVAL;
+    else
+        rx->poll_on = val;
+    spin_unlock_irqrestore(&port->lock, flags);
+    return ret;
+}
+
+static ssize_t show_rx_poll_off(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    struct uart_port *port = dev_get_drvdata(dev);
+
+    return sprintf(buffer, "%u\n", usb_uart_rx[port->line].poll_off);
+}
+
+static ssize_t store_rx_poll_off(struct device *dev,
+        struct device_attribute *attr, const char *buffer, size_t count)
+{
+    struct uart_port *port = dev_get_drvdata(dev);
+    struct usb_uart_rx *rx = &usb_uart_rx[port->line];
+    unsigned long flags;
+    unsigned int val;
+    int ret = count;
+
+    if (sscanf(buffer, "%u", &val) != 1) return -EINVAL;
+
+    spin_lock_irqsave(&port->lock, flags);
+    if (rx->poll_on && (!val || val > rx->poll_on))
+        ret = -EINVAL;
+    else
+        rx->poll_off = val;
+    spin_unlock_irqrestore(&port->lock, flags);
+    return ret;
+}
+
+/* Mode, time spent in each mode in ns including the current one, and
+ * the number of mode changes */
+static ssize_t show_rx_mode(struct device *dev,
+        struct device_attribute *attr, char *buffer)
+{
+    struct uart_port *port = dev_get_drvdata(dev);
+    struct usb_uart_rx *rx = &usb_uart_rx[port->line];
+    u64 ns[2];
+    unsigned long flags;
+    int polling;
+
+    spin_lock_irqsave(&port->lock, flags);
+    polling = rx->polling;
+    ns[0] = rx->mode_ns[0];
+    ns[1] = rx->mode_ns[1];
+    ns[polling] += ktime_to_ns(ktime_sub(ktime_get(), rx->since));
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    return sprintf(buffer, "%s irq_ns %llu poll_ns %llu switches %lu\n",
+            polling ? "poll" : "irq", (unsigned long long)ns[0],
+            (unsigned long long)ns[1], rx->switches);
+}
+
+DEVICE_ATTR(rx_poll_on, 0644, show_rx_poll_on, store_rx_poll_on);
+DEVICE_ATTR(rx_poll_off, 0644, show_rx_poll_off, store_rx_poll_off);
+DEVICE_ATTR(rx_mode, 0444, show_rx_mode, NULL);
+
+/* Attribute Descriptor */
+static struct attribute *usb_uart_attrs[] = {
+    &dev_attr_rx_poll_on.attr,
+    &dev_attr_rx_poll_off.attr,
+    &dev_attr_rx_mode.attr,
+    NULL
+};
+
+/* Attribute group */
+static struct attribute_group usb_uart_attr_group = {
+    .attrs = usb_uart_attrs,
+};
+
 /* Called when the platform driver is unregistered */
 staitc int usb_uart_remove(struct platform_device *dev)
 {
+    sysfs_remove_group(&dev->dev.kobj, &usb_uart_attr_group);
     platform_set_drvdata(dev, NULL);
 
     /* Remove the USB_UART port from the serial core */
@@ -256,13 +623,24 @@ static sturct uart_port usb_uart_port[] = {
 /* Platform driver probe */
 static int __init usb_uart_probe(struct platform_device *dev)
 {
+    struct usb_uart_rx *rx = &usb_uart_rx[dev->id];
+
     /* ... */
 
+    /* Hybrid RX starts in interrupt mode. Poll above roughly one
+     * FIFO per millisecond, stop below a quarter of that */
+    rx->port = &usb_uart_port[dev->id];
+    rx->poll_on = USB_UART_FIFO_SIZE * 1000;
+    rx->poll_off = rx->poll_on / 4;
+    hrtimer_init(&rx->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    rx->timer.function = usb_uart_rx_poll;
+
     /* Add a USB_UART port. This function also registers this device
      * with the tty layer and triggers invocation of the config_port()
      * entry point */
     uart_add_one_port(&usb_uart_reg, &usb_uart_port[dev->id]);
     platform_set_drvdata(dev, &usb_uart_port[dev->id]);
+    sysfs_create_group(&dev->dev.kobj, &usb_uart_attr_group);
     return 0;
 }
 